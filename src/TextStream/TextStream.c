@@ -1,10 +1,25 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #ifndef __TEXTUTILSTREAM_INCLUDED
 #include "TextStream.h"
 #endif
+#ifndef OSSTRLEN
 #define OSSTRLEN strlen
 #define OSSTROUT snprintf
 #endif
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+void loadrecorddata(TextUtilStream *, char *);
+void spillIfOverBudget(TextUtilStream *);
 
  /**
   * @file textutilstream.c
@@ -67,12 +82,31 @@
  */
 void loaddata(TextUtilStream *in, char *fmt, ...) {
   va_list remaining;
+  va_list again;
+  char buffer[4096];
+  char *text = buffer;
+  int len = 0;
   va_start(remaining,fmt);
-  if (in->buffered) {
-      char buffer[4096];
-      memset(&buffer, 0, 4096);
-      vsprintf(buffer, fmt, remaining);
-      str_append(in->stream, buffer);
+  if (in->records || in->buffered) {
+      /* a long value is formatted again into memory of its own */
+      va_copy(again, remaining);
+      len = vsnprintf(buffer, sizeof(buffer), fmt, remaining);
+      if (len < 0) {
+          len = 0;
+          buffer[0] = '\0';
+      } else if (len >= (int) sizeof(buffer)) {
+          mstralloc(text, (len + 1));
+          vsnprintf(text, len + 1, fmt, again);
+      }
+      va_end(again);
+      if (in->records) {
+          loadrecorddata(in, text);
+      } else {
+          in->length += len;
+          str_append(in->stream, text);
+          spillIfOverBudget(in);
+      }
+      if (text != buffer) mfree(text);
   } else {
       vfprintf(in->output, fmt, remaining);
   }
@@ -82,16 +116,244 @@ void loaddata(TextUtilStream *in, char *fmt, ...) {
 void loadsmalldata(TextUtilStream *in, char *rest) {
     loaddata(in, "%s", rest);
 }
+/*
+ * loads text that may be larger than the `loaddata` buffer,
+ * such as a spliced fragment.
+ */
+void loadrawdata(TextUtilStream *in, char *text) {
+    char *copy = NULL;
+    if (in->records) {
+        mstrdup(copy, text);
+        loadrecorddata(in, copy);
+        mfree(copy);
+    } else if (in->buffered) {
+        str_append(in->stream, text);
+        in->length += strlen(text);
+        spillIfOverBudget(in);
+    } else {
+        fputs(text, in->output);
+    }
+}
+/*
+ * a record is an object directly under the top level, or under
+ * a list directly under the top level.
+ */
+int isRecord(TextUtilStream *that) {
+    if ((that == NULL) || (! that->records)) return 0;
+    if ((that->type != HASH) || (that->parent == NULL)) return 0;
+    if (that->parent->parent == NULL) return 1;
+    return ((that->parent->type == ARRAY) && (that->parent->parent->parent == NULL));
+}
+/*
+ * finds the record, or captured fragment within it, that holds
+ * the text written to `in`.
+ */
+TextUtilStream *recordOwner(TextUtilStream *in) {
+    TextUtilStream *tmp = in;
+    while (tmp != NULL) {
+        if ((tmp->capture != NULL) || isRecord(tmp)) return tmp;
+        tmp = tmp->parent;
+    }
+    return NULL;
+}
+/**
+ * writes `length` bytes of `text` to `output` with a single write where
+ * it has a descriptor, after anything already buffered in it, so a
+ * reader never sees part of it. Falls back to stdio otherwise.
+ */
+void writeTextUtilOutput(FILE *output, char *text, size_t length) {
+    ssize_t done = 0;
+    int fd = -1;
+    flockfile(output);
+    fflush(output);
+    fd = fileno(output);
+    while ((fd >= 0) && (length > 0)) {
+        done = write(fd, text, length);
+        if ((done < 0) && (errno == EINTR)) continue;
+        if (done <= 0) break;
+        text += done;
+        length -= done;
+    }
+    if (length > 0) {
+        fwrite(text, 1, length, output);
+        fflush(output);
+    }
+    funlockfile(output);
+}
+/*
+ * writes out the text held for a record.
+ */
+void flushRecord(TextUtilStream *record) {
+    if (record->stream == NULL) return;
+    writeTextUtilOutput(record->output, record->stream, record->length);
+    mfree(record->stream);
+    record->stream = (char *) NULL;
+    record->length = 0;
+}
+/*
+ * adds text to the record that holds it. Text outside of any record
+ * is not written.
+ */
+void loadrecorddata(TextUtilStream *in, char *text) {
+    TextUtilStream *owner = recordOwner(in);
+    if (owner == NULL) return;
+    str_append(owner->stream, text);
+    owner->length += strlen(text);
+    if ((owner->highwater == 0) || (owner->length <= owner->highwater)) return;
+    if (owner->backpressure == NULL) return;
+    if (owner->backpressure(owner, owner->length) && isRecord(owner)) {
+        flushRecord(owner);
+    }
+}
+/*
+ * record mode keeps each record on one line, so a newline in a value is
+ * written escaped. Returns `value`, or a copy in `*copy` to be freed.
+ */
+char *recordValue(TextUtilStream *that, char *value, char **copy) {
+    char *escape = (that->otype == XML) ? "&#10;" : "\\n";
+    char *in = NULL;
+    char *out = NULL;
+    size_t lines = 0;
+    if ((! that->records) || (value == NULL) || (strchr(value, '\n') == NULL)) return value;
+    for (in = value; *in != '\0'; in++) {
+        if (*in == '\n') lines++;
+    }
+    mstralloc(*copy, (strlen(value) + (lines * strlen(escape)) + 1));
+    out = *copy;
+    for (in = value; *in != '\0'; in++) {
+        if (*in == '\n') {
+            strcpy(out, escape);
+            out += strlen(escape);
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return *copy;
+}
+/*
+ * opens an unnamed temporary file to hold the spilled part of a document.
+ */
+int openSpillFile(void) {
+    char tmpname[1024];
+    char *dir = getenv("TMPDIR");
+    int fd = -1;
+    if ((dir == NULL) || (strlen(dir) == 0)) dir = "/tmp";
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd >= 0) return fd;
+#endif
+    snprintf(tmpname, sizeof(tmpname), "%s/textutilstreamXXXXXX", dir);
+    fd = mkstemp(tmpname);
+    if (fd >= 0) unlink(tmpname);
+    return fd;
+}
+/*
+ * moves the text held from the top level down to `node` into the spill
+ * file, in document order. A captured fragment, and anything below it,
+ * stays in memory. Returns 0 once a stream could not be spilled. When the
+ * spill file cannot be written, only the text not yet in it is kept, and
+ * the rest of the document stays in memory.
+ */
+int spillChain(TextUtilStream *root, TextUtilStream *node) {
+    char *ptr = NULL;
+    size_t left = 0;
+    ssize_t done = 0;
+    if (node->parent != NULL) {
+        if (! spillChain(root, node->parent)) return 0;
+    }
+    if ((node->capture != NULL) || (! node->buffered)) return 0;
+    if (node->stream == NULL) return 1;
+    ptr = node->stream;
+    left = node->length;
+    while (left > 0) {
+        done = write(root->spillfd, ptr, left);
+        if ((done < 0) && (errno == EINTR)) continue;
+        if (done <= 0) {
+            memmove(node->stream, ptr, left + 1);
+            node->length = left;
+            root->budget = 0;
+            return 0;
+        }
+        ptr += done;
+        left -= done;
+    }
+    mfree(node->stream);
+    node->stream = (char *) NULL;
+    node->length = 0;
+    return 1;
+}
+/*
+ * spills the document held in memory once it grows past the budget
+ * of its top level stream.
+ */
+void spillIfOverBudget(TextUtilStream *in) {
+    TextUtilStream *root = in;
+    size_t held = in->length;
+    while (root->parent != NULL) {
+        root = root->parent;
+        held += root->length;
+    }
+    if ((root->budget == 0) || (held <= root->budget)) return;
+    if (root->spillfd < 0) root->spillfd = openSpillFile();
+    if (root->spillfd < 0) {
+        /* nowhere to spill to, keep the document in memory */
+        root->budget = 0;
+        return;
+    }
+    spillChain(root, in);
+}
+/*
+ * copies the spill file to the output, ahead of the text still in memory.
+ * Uses copy_file_range or sendfile where the kernel allows it.
+ */
+void copySpillFile(TextUtilStream *root) {
+    char buffer[4096];
+    off_t offset = 0;
+    off_t size = lseek(root->spillfd, 0, SEEK_END);
+    ssize_t done = 0;
+    int fd = -1;
+    fflush(root->output);
+    fd = fileno(root->output);
+#ifdef __linux__
+    while ((fd >= 0) && (offset < size)) {
+        done = copy_file_range(root->spillfd, &offset, fd, NULL, size - offset, 0);
+        if (done <= 0) break;
+    }
+    while ((fd >= 0) && (offset < size)) {
+        done = sendfile(fd, root->spillfd, &offset, size - offset);
+        if (done <= 0) break;
+    }
+#endif
+    while (offset < size) {
+        done = pread(root->spillfd, buffer, sizeof(buffer), offset);
+        if ((done < 0) && (errno == EINTR)) continue;
+        if (done <= 0) break;
+        fwrite(buffer, 1, done, root->output);
+        offset += done;
+    }
+    close(root->spillfd);
+    root->spillfd = -1;
+}
 /*
  * this routine prints the indentation
  */
 void printSpaces(TextUtilStream *that, int howmany) {
     int i = 0;
     if (that == NULL) return;
+    if (that->records) return;
     if (that->otype == TCL) return;
     if (that->otype == CSV) return;
     for (i =0; i <=howmany; i++) loadsmalldata(that, " ");
 }
+/*
+ * this routine ends a line, except in record mode.
+ */
+void printNewline(TextUtilStream *that) {
+    if (that == NULL) return;
+    if (that->records) return;
+    loadsmalldata(that, "\n");
+}
 /*
  * routine completes the prior line, either adding
  * a newline or a comma with a newline.
@@ -105,6 +367,12 @@ void finishPriorLine(TextUtilStream *that, int newobject) {
     if (that->level == 0) return;
     if (that->count > 0) needscomma = 1;
     else needscomma = 0;
+    if (that->records) {
+        if ((! needscomma) || (that->otype == CSV)) return;
+        if ((that->otype == JSON) || (that->otype == PERL)) loadsmalldata(that, ",");
+        else loadsmalldata(that, " ");
+        return;
+    }
     if (that->parent != NULL) {
         if (that->parent->type == HASH) {
             switch (that->otype) {
@@ -177,6 +445,13 @@ TextUtilStream *_createTextUtilStream(FILE *output, OutputType otype, int buffer
     that->exclude_these = NULL;
     that->buffered = buffered;
     that->stream = (char *) NULL;
+    that->length = 0;
+    that->budget = 0;
+    that->spillfd = -1;
+    that->records = 0;
+    that->highwater = 0;
+    that->backpressure = NULL;
+    that->capture = NULL;
     return that;
 }
 /**
@@ -191,6 +466,38 @@ TextUtilStream *newBufferedTextUtilStream(FILE *output, OutputType otype) {
 TextUtilStream *newTextUtilStream(FILE *output, OutputType otype) {
     return _createTextUtilStream(output, otype, 0);
 }
+/**
+ * creates a new record TextUtilStream.
+ *
+ * Each object under the top level, or under a list under the top level,
+ * is written as one line (JSON Lines, a CSV row, one XML element) when it
+ * is destroyed. Nothing else is written, so memory is bounded by the
+ * largest record rather than the whole document. A newline in a value is
+ * written as `\n` (`&#10;` in XML) to keep the record on its line.
+ */
+TextUtilStream *newRecordTextUtilStream(FILE *output, OutputType otype) {
+    TextUtilStream *that = _createTextUtilStream(output, otype, 0);
+    that->records = 1;
+    return that;
+}
+/**
+ * sets how much of a buffered document may be held in memory.
+ * Past the budget, completed text is moved to an unnamed temporary file
+ * and copied to the output when the top level stream is destroyed.
+ */
+void setMemoryBudget(TextUtilStream *stream, size_t budget) {
+    if (stream == NULL) return;
+    stream->budget = budget;
+}
+/**
+ * sets the size a record may reach before `backpressure` is called.
+ * Streams created afterwards under `stream` share the setting.
+ */
+void setRecordHighWater(TextUtilStream *stream, size_t highwater, TextUtilBackpressure backpressure) {
+    if (stream == NULL) return;
+    stream->highwater = highwater;
+    stream->backpressure = backpressure;
+}
 
 int findNumberOfParents(TextUtilStream *what) {
     int count = 0;
@@ -211,7 +518,7 @@ void initList( TextUtilStream *list, char *name) {
             else  { loaddata(list,"%c", 123);}
             break;
         case CSV:
-            loadsmalldata(list,"\n");
+            printNewline(list);
             break;
         case JSON:
             if (strlen(name) > 0) { loaddata(list,"\"%s\": [", NSTR(name));}
@@ -257,7 +564,7 @@ void initObject( TextUtilStream *obj, char *name) {
             break;
     }
 }
-TextUtilStream *createExpandedType(TextUtilStream *what, char *name, StructType type) {
+TextUtilStream *createExpandedType(TextUtilStream *what, char *name, StructType type, TextUtilFragment *capture) {
     TextUtilStream *expandedtype = (TextUtilStream*) NULL;
     char tmpname[1024];
     if (what == NULL) return expandedtype;
@@ -265,6 +572,12 @@ TextUtilStream *createExpandedType(TextUtilStream *what, char *name, StructType
     expandedtype->parent = what;
     expandedtype->buffered = what->buffered;
     expandedtype->stream = NULL;
+    expandedtype->length = 0;
+    expandedtype->budget = 0;
+    expandedtype->spillfd = -1;
+    expandedtype->records = what->records;
+    expandedtype->highwater = what->highwater;
+    expandedtype->backpressure = what->backpressure;
     expandedtype->otype = what->otype;
     expandedtype->output = what->output;
     expandedtype->level = (expandedtype->parent->level + 1);
@@ -272,6 +585,11 @@ TextUtilStream *createExpandedType(TextUtilStream *what, char *name, StructType
     expandedtype->type = type;
     expandedtype->include_these = NULL;
     expandedtype->exclude_these = NULL;
+    expandedtype->capture = capture;
+    if ((capture != NULL) && (! expandedtype->records)) {
+        /* a captured subtree is always buffered, so its text can be kept */
+        expandedtype->buffered = 1;
+    }
     if (expandedtype->parent->include_these != NULL) {
         mstrdup((expandedtype->include_these),(expandedtype->parent->include_these));
     } else {
@@ -319,7 +637,7 @@ TextUtilStream *createObject(TextUtilStream *obj, char *name) {
   if (obj == NULL) return NULL;
   finishPriorLine(obj,1);
   printSpaces(obj, obj->level+1);
-  return (TextUtilStream*) createExpandedType(obj, name, HASH);
+  return (TextUtilStream*) createExpandedType(obj, name, HASH, NULL);
 }
 /**
  * creates a new list TextUtilStream
@@ -328,7 +646,132 @@ TextUtilStream *createList(TextUtilStream *obj, char *name) {
   if (obj == NULL) return NULL;
   finishPriorLine(obj,1);
   printSpaces(obj, obj->level+1);
-  return (TextUtilStream*) createExpandedType(obj, name, ARRAY);
+  return (TextUtilStream*) createExpandedType(obj, name, ARRAY, NULL);
+}
+/**
+ * creates a new object TextUtilStream whose serialized text is kept
+ * in `frag` when it is destroyed, tagged with `version`.
+ * @code
+    if (! spliceFragment(outer, status, version)) {
+        inner1 = createFragment(outer, "", status, version);
+        addString(inner1, "feature", "Fabulous New Feature");
+        destroy(inner1);
+    }
+ * @endcode
+ */
+TextUtilStream *createFragment(TextUtilStream *obj, char *name, TextUtilFragment *frag, long version) {
+  TextUtilStream *that = NULL;
+  if (obj == NULL) return NULL;
+  if (frag == NULL) return createObject(obj, name);
+  finishPriorLine(obj,1);
+  printSpaces(obj, obj->level+1);
+  that = (TextUtilStream*) createExpandedType(obj, name, HASH, frag);
+  frag->pending = version;
+  frag->newlines = 0;
+  return that;
+}
+/**
+ * private function, copies the text of a captured subtree into its fragment.
+ */
+void keepFragment(TextUtilStream *obj) {
+    TextUtilFragment *frag = obj->capture;
+    if (frag->text != NULL) mfree(frag->text);
+    if (obj->stream != NULL) {mstrdup(frag->text, obj->stream);}
+    else {mstrdup(frag->text, "");}
+    frag->length = strlen(frag->text);
+    frag->level = obj->level;
+    frag->otype = obj->otype;
+    frag->version = frag->pending;
+}
+/**
+ * private function, notes in the fragment being captured above `that`
+ * when `value` spans lines, since reindenting would change the value.
+ */
+void captureNewlines(TextUtilStream *that, char *value) {
+    if ((value == NULL) || (strchr(value, '\n') == NULL)) return;
+    for (; that != NULL; that = that->parent) {
+        if (that->capture != NULL) that->capture->newlines = 1;
+    }
+}
+/**
+ * private function, returns a copy of the fragment text with every line
+ * after the first moved `shift` spaces right (or left, when negative).
+ */
+char *reindentFragment(TextUtilFragment *frag, int shift) {
+    char *newvalue = NULL;
+    char *out = NULL;
+    char *in = frag->text;
+    char *eol = NULL;
+    size_t lines = 0;
+    size_t len = 0;
+    int i = 0;
+    for (eol = in; (eol = strchr(eol, '\n')) != NULL; eol++) lines++;
+    mstralloc(newvalue, (frag->length + ((shift > 0) ? (lines * shift) : 0) + 1));
+    out = newvalue;
+    while ((eol = strchr(in, '\n')) != NULL) {
+        len = (eol - in) + 1;
+        memcpy(out, in, len);
+        out += len;
+        in += len;
+        if (shift > 0) {
+            memset(out, ' ', shift);
+            out += shift;
+        } else {
+            for (i = 0; (i < -shift) && (*in == ' '); i++) in++;
+        }
+    }
+    len = strlen(in);
+    memcpy(out, in, len);
+    out[len] = '\0';
+    return newvalue;
+}
+/**
+ * adds the object kept in `frag` to a TextUtilStream, if the fragment
+ * holds `version`. Returns 0 when the caller must serialize the object itself.
+ */
+int spliceFragment(TextUtilStream *obj, TextUtilFragment *frag, long version) {
+    char *newvalue = NULL;
+    int shift = 0;
+    if ((obj == NULL) || (frag == NULL)) return 0;
+    if (frag->text == NULL) return 0;
+    if (frag->version != version) return 0;
+    if (frag->otype != obj->otype) return 0;
+    /* a fragment kept outside record mode spans lines */
+    if (obj->records && (strchr(frag->text, '\n') != NULL)) return 0;
+    shift = (obj->level + 1) - frag->level;
+    /* a value spanning lines would be reindented with the structure */
+    if ((shift != 0) && frag->newlines && (obj->otype != TCL) && (obj->otype != CSV)) return 0;
+    finishPriorLine(obj,1);
+    printSpaces(obj, obj->level+1);
+    if ((shift == 0) || (obj->otype == TCL) || (obj->otype == CSV)) {
+        loadrawdata(obj, frag->text);
+    } else {
+        newvalue = reindentFragment(frag, shift);
+        loadrawdata(obj, newvalue);
+        mfree(newvalue);
+    }
+    obj->count++;
+    return 1;
+}
+/**
+ * creates an empty fragment for `createFragment`.
+ */
+TextUtilFragment *newTextUtilFragment(void) {
+    TextUtilFragment *frag = NULL;
+    frag = (TextUtilFragment *) mobjalloc(sizeof(TextUtilFragment));
+    frag->otype = STRING;
+    frag->level = 0;
+    frag->version = 0;
+    frag->pending = 0;
+    frag->newlines = 0;
+    frag->length = 0;
+    frag->text = (char *) NULL;
+    return frag;
+}
+void destroyFragment(TextUtilFragment *frag) {
+    if (frag == NULL) return;
+    if (frag->text != NULL) mfree(frag->text);
+    mfree(frag);
 }
 /**
  * private function to determine if the item is filtered.
@@ -365,9 +808,12 @@ int filteredOut(TextUtilStream *obj, char *name) {
 }
 
 void addToList(TextUtilStream *list, char *name, char *value) {
+    char *copy = NULL;
     if (list == NULL) return;
     if (list->parent == NULL) return;
     if (! filteredOut(list, name)) return;
+    value = recordValue(list, value, &copy);
+    captureNewlines(list, value);
     finishPriorLine(list,0);
     printSpaces(list, list->level+1);
     switch (list->otype) {
@@ -390,12 +836,14 @@ void addToList(TextUtilStream *list, char *name, char *value) {
             loaddata(list,"%s", NSTR(value));
             break;
     }
+    if (copy != NULL) mfree(copy);
     list->count++;
 }
 /**
  * pubic function for adding an item to an object.
  */
 void addToObject(TextUtilStream *obj, char *name, char *value) {
+    char *copy = NULL;
     if (obj == NULL) {
         fprintf(stderr, "no this for object!\n");
         return;
@@ -407,6 +855,8 @@ void addToObject(TextUtilStream *obj, char *name, char *value) {
     if (! filteredOut(obj, name)) {
         return;
     }
+    value = recordValue(obj, value, &copy);
+    captureNewlines(obj, value);
     finishPriorLine(obj,0);
     printSpaces(obj, obj->level+1);
     switch (obj->otype) {
@@ -429,6 +879,7 @@ void addToObject(TextUtilStream *obj, char *name, char *value) {
             loaddata(obj,"%s = %s", NSTR(name), NSTR(value));
             break;
     }
+    if (copy != NULL) mfree(copy);
     obj->count++;
 }
 /**
@@ -543,12 +994,12 @@ void destroyList(TextUtilStream *list) {
             loaddata(list,"%c", 125);
             break;
         case JSON:
-    loadsmalldata(list,"\n");
+    printNewline(list);
     printSpaces(list, list->level);
             loadsmalldata(list,"]");
             break;
         case XML:
-    loadsmalldata(list,"\n");
+    printNewline(list);
     printSpaces(list, list->level);
             loadsmalldata(list,"</list>");
             break;
@@ -556,7 +1007,7 @@ void destroyList(TextUtilStream *list) {
     printSpaces(list, list->level);
             break;
         case PERL:
-    loadsmalldata(list,"\n");
+    printNewline(list);
     printSpaces(list, list->level);
             loadsmalldata(list,"]");
             break;
@@ -570,21 +1021,21 @@ void destroyObject(TextUtilStream *obj) {
             loaddata(obj,"%c ", 125);
             break;
         case JSON:
-            loadsmalldata(obj,"\n");
+            printNewline(obj);
     printSpaces(obj, obj->level);
             loaddata(obj,"%c", 125);
             break;
         case XML:
-            loadsmalldata(obj,"\n");
+            printNewline(obj);
     printSpaces(obj, obj->level);
             loadsmalldata(obj,"</object>");
             break;
         case CSV:
-            loadsmalldata(obj,"\n");
+            printNewline(obj);
     printSpaces(obj, obj->level);
             break;
         case PERL:
-            loadsmalldata(obj,"\n");
+            printNewline(obj);
     printSpaces(obj, obj->level);
             loaddata(obj,"%c", 125);
             break;
@@ -604,9 +1055,32 @@ void destroy(TextUtilStream *obj) {
         case 1: {destroyObject(obj);break;}
         case 2: {destroyList(obj);break;}
     }
-    if ((obj->buffered ==1) && (obj->stream !=NULL)) {
+    if (obj->capture != NULL) keepFragment(obj);
+    if (obj->spillfd >= 0) copySpillFile(obj);
+    if (obj->records) {
+        if (isRecord(obj)) {
+            str_append(obj->stream, "\n");
+            obj->length++;
+            flushRecord(obj);
+        } else if (obj->stream != NULL) {
+            parent = recordOwner(obj->parent);
+            if (parent != NULL) {
+                str_append(parent->stream, obj->stream);
+                parent->length += obj->length;
+            }
+            mfree(obj->stream);
+            obj->stream = (char *) NULL;
+        }
+    } else if ((obj->buffered ==1) && (obj->stream !=NULL)) {
     char *ptr = obj->stream;
-    fprintf(obj->output, "%s", ptr);
+    if ((obj->parent != NULL) && (obj->parent->buffered)) {
+        /* keep the document in order, the parent writes it out */
+        str_append(obj->parent->stream, ptr);
+        obj->parent->length += obj->length;
+        spillIfOverBudget(obj->parent);
+    } else {
+        fprintf(obj->output, "%s", ptr);
+    }
     mfree(obj->stream);
     obj->stream = (char *) NULL;
     }
@@ -642,6 +1116,253 @@ void excludeThis(TextUtilStream *stream, char *optarg) {
     mfree(addons);
 }
 
+/* a value the test object also holds, when set */
+char *testMessage = NULL;
+/*
+ * test helper, writes a document with one object `nest` lists down and
+ * destroys `toplevel`. The object is spliced from, or else kept in, `frag`.
+ */
+void writeTestDocument(TextUtilStream *toplevel, int nest, TextUtilFragment *frag) {
+    TextUtilStream *lists[8];
+    TextUtilStream *obj, *users, *user;
+    int i = 0;
+    lists[0] = createList(toplevel, "");
+    for (i = 1; i <= nest; i++) lists[i] = createList(lists[i - 1], "nested");
+    addString(lists[nest], "", "before");
+    if (! spliceFragment(lists[nest], frag, 1)) {
+        obj = createFragment(lists[nest], "", frag, 1);
+        addString(obj, "feature", "Fabulous New Feature");
+        addNumber(obj, "available", 121);
+        if (testMessage != NULL) addString(obj, "msg", testMessage);
+        users = createList(obj, "users");
+        user = createObject(users, "user");
+        addString(user, "user", "Ben Painter");
+        addNumber(user, "number", 10);
+        destroy(user);
+        addString(users, "", "guest");
+        destroy(users);
+        destroy(obj);
+    }
+    addString(lists[nest], "", "after");
+    for (i = nest; i >= 0; i--) destroy(lists[i]);
+    destroy(toplevel);
+}
+/*
+ * test helper, returns the document from `writeTestDocument` as a string.
+ */
+char *testDocument(OutputType otype, int buffered, int nest, TextUtilFragment *frag) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *output = open_memstream(&text, &length);
+    if (output == NULL) return NULL;
+    if (buffered) writeTestDocument(newBufferedTextUtilStream(output, otype), nest, frag);
+    else writeTestDocument(newTextUtilStream(output, otype), nest, frag);
+    fclose(output);
+    return text;
+}
+/*
+ * test helper, returns the document written buffered under a memory
+ * budget of `budget` bytes to `output`, after `prefix`.
+ */
+char *testSpilledDocument(FILE *output, char *prefix, OutputType otype, size_t budget, TextUtilFragment *frag) {
+    TextUtilStream *toplevel = newBufferedTextUtilStream(output, otype);
+    char *text = NULL;
+    long size = 0;
+    setMemoryBudget(toplevel, budget);
+    fputs(prefix, output);
+    writeTestDocument(toplevel, 1, frag);
+    fflush(output);
+    size = ftell(output);
+    if (size < (long) strlen(prefix)) return NULL;
+    mstralloc(text, size + 1);
+    rewind(output);
+    if (fread(text, 1, size, output) != (size_t) size) text[0] = '\0';
+    text[size] = '\0';
+    fclose(output);
+    return text;
+}
+/*
+ * test helper, returns the document written under a memory budget of
+ * `budget` bytes while no file may grow past `limit` bytes, so that
+ * writing the spill file fails partway.
+ */
+char *testFullSpillDocument(OutputType otype, size_t budget, rlim_t limit) {
+    TextUtilStream *toplevel = NULL;
+    struct rlimit saved, small;
+    void (*handler)(int) = NULL;
+    char *text = NULL;
+    size_t length = 0;
+    FILE *output = open_memstream(&text, &length);
+    if ((output == NULL) || (getrlimit(RLIMIT_FSIZE, &saved) != 0)) return NULL;
+    small = saved;
+    small.rlim_cur = limit;
+    handler = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &small);
+    toplevel = newBufferedTextUtilStream(output, otype);
+    setMemoryBudget(toplevel, budget);
+    writeTestDocument(toplevel, 1, NULL);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, handler);
+    fclose(output);
+    return text;
+}
+/*
+ * test helper, reports whether `got` matches `expected`.
+ */
+int testSame(char *what, OutputType otype, char *expected, char *got) {
+    if ((expected != NULL) && (got != NULL) && (strcmp(expected, got) == 0)) return 1;
+    fprintf(stderr, "testTextUtilStream: %s differs for output type %d\n", what, otype);
+    fprintf(stderr, "expected:\n%s\ngot:\n%s\n", NSTR(expected), NSTR(got));
+    return 0;
+}
+/*
+ * checks that buffering, and splicing a kept fragment at the depth it
+ * was written or deeper, give the same text as formatting it directly.
+ */
+int testTextUtilFragments(void) {
+    TextUtilFragment *frag = NULL;
+    char *plain = NULL, *deeper = NULL, *got = NULL;
+    int status = 0;
+    int i = 0;
+    for (i = STRING; i <= CSV; i++) {
+        plain = testDocument((OutputType) i, 0, 1, NULL);
+        deeper = testDocument((OutputType) i, 0, 3, NULL);
+        got = testDocument((OutputType) i, 1, 1, NULL);
+        if (! testSame("buffered document", (OutputType) i, plain, got)) status = 1;
+        free(got);
+        frag = newTextUtilFragment();
+        got = testDocument((OutputType) i, 0, 1, frag);
+        if (! testSame("captured fragment", (OutputType) i, plain, got)) status = 1;
+        free(got);
+        got = testDocument((OutputType) i, 0, 1, frag);
+        if (! testSame("spliced fragment", (OutputType) i, plain, got)) status = 1;
+        free(got);
+        got = testDocument((OutputType) i, 1, 3, frag);
+        if (! testSame("fragment spliced deeper", (OutputType) i, deeper, got)) status = 1;
+        free(got);
+        destroyFragment(frag);
+        free(plain);
+        free(deeper);
+        /* a value spanning lines keeps its text when spliced deeper */
+        testMessage = "line1\nline2";
+        deeper = testDocument((OutputType) i, 0, 3, NULL);
+        frag = newTextUtilFragment();
+        free(testDocument((OutputType) i, 0, 1, frag));
+        got = testDocument((OutputType) i, 0, 3, frag);
+        if (! testSame("fragment with a multi-line value spliced deeper", (OutputType) i, deeper, got)) status = 1;
+        free(got);
+        destroyFragment(frag);
+        free(deeper);
+        testMessage = NULL;
+    }
+    return status;
+}
+
+/*
+ * checks that a document spilled to a temporary file under a tiny memory
+ * budget, with or without a fragment kept from it, or with the spill file
+ * filling up, comes out unchanged.
+ */
+int testTextUtilSpill(void) {
+    TextUtilFragment *frag = NULL;
+    char *plain = NULL, *got = NULL, *expected = NULL;
+    FILE *output = NULL;
+    int status = 0;
+    int i = 0;
+    for (i = STRING; i <= CSV; i++) {
+        plain = testDocument((OutputType) i, 0, 1, NULL);
+        if (plain == NULL) return 1;
+        output = tmpfile();
+        if (output == NULL) return 1;
+        got = testSpilledDocument(output, "", (OutputType) i, 16, NULL);
+        if (! testSame("spilled document", (OutputType) i, plain, got)) status = 1;
+        if (got != NULL) mfree(got);
+        /* an append stream, after text already in the file */
+        output = fdopen(openSpillFile(), "a+");
+        if (output == NULL) return 1;
+        mstralloc(expected, strlen(plain) + 8);
+        strcpy(expected, "header\n");
+        strcat(expected, plain);
+        got = testSpilledDocument(output, "header\n", (OutputType) i, 1, NULL);
+        if (! testSame("spilled document after text", (OutputType) i, expected, got)) status = 1;
+        if (got != NULL) mfree(got);
+        mfree(expected);
+        frag = newTextUtilFragment();
+        got = testSpilledDocument(tmpfile(), "", (OutputType) i, 16, frag);
+        if (! testSame("spilled document with a fragment", (OutputType) i, plain, got)) status = 1;
+        if (got != NULL) mfree(got);
+        got = testDocument((OutputType) i, 0, 1, frag);
+        if (! testSame("fragment kept while spilling", (OutputType) i, plain, got)) status = 1;
+        free(got);
+        destroyFragment(frag);
+        got = testFullSpillDocument((OutputType) i, 16, 40);
+        if (! testSame("document spilled to a full file", (OutputType) i, plain, got)) status = 1;
+        free(got);
+        free(plain);
+    }
+    return status;
+}
+int testHighWaterCalls = 0;
+int testHighWater(TextUtilStream *record, size_t held) {
+    if ((record != NULL) && (held > 0)) testHighWaterCalls++;
+    return 1;
+}
+/*
+ * checks that record mode writes one line per record, keeps newlines in
+ * values, and calls the high-water callback without splitting records.
+ */
+int testTextUtilRecords(void) {
+    OutputType types[] = {TCL, JSON, XML, PERL, CSV};
+    TextUtilStream *toplevel, *list, *record, *users;
+    char *text = NULL;
+    char *ptr = NULL;
+    size_t length = 0;
+    FILE *output = NULL;
+    int lines = 0;
+    int status = 0;
+    int i = 0;
+    int j = 0;
+    for (i = 0; i < (int) (sizeof(types) / sizeof(types[0])); i++) {
+        testHighWaterCalls = 0;
+        output = open_memstream(&text, &length);
+        if (output == NULL) return 1;
+        toplevel = newRecordTextUtilStream(output, types[i]);
+        setRecordHighWater(toplevel, 16, testHighWater);
+        list = createList(toplevel, "records");
+        for (j = 0; j < 3; j++) {
+            record = createObject(list, "");
+            addString(record, "text", "line1\nline2");
+            addNumber(record, "number", j);
+            users = createList(record, "users");
+            addString(users, "", "Ben Painter");
+            destroy(users);
+            destroy(record);
+        }
+        destroy(list);
+        destroy(toplevel);
+        fclose(output);
+        lines = 0;
+        for (ptr = text; *ptr != '\0'; ptr++) {
+            if (*ptr == '\n') lines++;
+        }
+        if ((lines != 3) || (length == 0) || (text[length - 1] != '\n')) {
+            fprintf(stderr, "testTextUtilStream: %d lines for 3 records, output type %d\n%s", lines, types[i], text);
+            status = 1;
+        }
+        if (strstr(text, "line1") == NULL) {
+            fprintf(stderr, "testTextUtilStream: record value lost, output type %d\n%s", types[i], text);
+            status = 1;
+        }
+        if (testHighWaterCalls == 0) {
+            fprintf(stderr, "testTextUtilStream: no high-water call, output type %d\n", types[i]);
+            status = 1;
+        }
+        free(text);
+        text = NULL;
+    }
+    return status;
+}
+
 int testTextUtilStream(int argc, char *argv[]) {
     int i = 0;
     int j = 0;
@@ -698,6 +1419,7 @@ printf ("\n____________________________________\n");
     addString(user, "date", "01-jun-2029");
     destroy(user);
     destroy(users);
+    users = createList(inner1, "users");
     user = createObject(users, "excludetest-onlyversion");
     includeThis(user, "expire:use:name");
     addString(user, "name", "milk");
@@ -711,6 +1433,8 @@ printf ("\n____________________________________\n");
     destroy(outer);
     destroy(toplevel);
     }
-    return 0;
+    if (testTextUtilFragments() != 0) return 1;
+    if (testTextUtilSpill() != 0) return 1;
+    return testTextUtilRecords();
 }
 
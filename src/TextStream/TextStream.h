@@ -9,6 +9,9 @@
 #define __TEXTUTILSTREAM_INCLUDED
 #include <stdio.h>
 #include <time.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
 /**
  * Used by Textutils to format output data
  */
@@ -40,6 +43,15 @@ typedef enum {
 } StructType;
 
 
+struct textUtilFragment;
+struct structuredOutputStream;
+
+/**
+ * Called when the text held for a record grows past its high-water mark.
+ * Return nonzero to write out what is held so far.
+ */
+typedef int (*TextUtilBackpressure)(struct structuredOutputStream *, size_t);
+
 typedef struct structuredOutputStream {
   FILE *output;
   char *include_these;
@@ -51,9 +63,35 @@ typedef struct structuredOutputStream {
   int type;
   int buffered;
   char *stream;
+  size_t length;
+  size_t budget;
+  int spillfd;
+  int records;
+  size_t highwater;
+  TextUtilBackpressure backpressure;
+  struct textUtilFragment *capture;
 } TextUtilStream;
 
+/**
+ * A serialized subtree, kept so an unchanged object can be spliced
+ * back into a later document instead of being formatted again.
+ */
+typedef struct textUtilFragment {
+  OutputType otype;
+  int level;
+  long version;
+  long pending;
+  int newlines;
+  size_t length;
+  char *text;
+} TextUtilFragment;
+
 TextUtilStream *newTextUtilStream(FILE *, OutputType );
+TextUtilStream *newBufferedTextUtilStream(FILE *, OutputType );
+TextUtilStream *newRecordTextUtilStream(FILE *, OutputType );
+void setRecordHighWater(TextUtilStream *, size_t, TextUtilBackpressure);
+void setMemoryBudget(TextUtilStream *, size_t);
+void writeTextUtilOutput(FILE *, char *, size_t);
 void includeThis(TextUtilStream *, char *);
 void excludeThis(TextUtilStream *, char *);
 TextUtilStream* createList(TextUtilStream *, char *);
@@ -64,8 +102,14 @@ void addString(TextUtilStream *, char *, char *);
 void addHexString(TextUtilStream *, char *, unsigned char *);
 void addTimestamp(TextUtilStream *, char *, time_t);
 void destroy(TextUtilStream *);
+TextUtilFragment *newTextUtilFragment(void);
+TextUtilStream* createFragment(TextUtilStream *, char *, TextUtilFragment *, long);
+int spliceFragment(TextUtilStream *, TextUtilFragment *, long);
+void destroyFragment(TextUtilFragment *);
 void hideNumber(TextUtilStream *, char *, int );
 void hideString(TextUtilStream *, char *, char * );
 int filteredOut(TextUtilStream *, char *);
+#ifdef __cplusplus
+}
+#endif
 #endif
-
@@ -0,0 +1,422 @@
+
+ /**
+  * @file TextStream.hpp
+  * @brief header only C++ layer over the TextStream formats
+  * @author thepainters@gmail.com
+  */
+
+/**
+ * Each `TextStream<Format, Sink>` is specialized for one `OutputType` at
+ * compile time, so the format switches of TextStream.c become constant
+ * tokens and `if constexpr` branches. Objects and lists are scopes that
+ * close themselves when they go out of scope.
+ *
+ * The output matches TextStream.c for the same calls, which
+ * `testTextStream()` checks in every format. Include and exclude
+ * filters, record mode and spilling are only in the C library.
+ * ## Example
+ * @code
+    textstream::TextStream<JSON, textstream::Buffer> toplevel;
+    {
+        auto outer = toplevel.createList("");
+        auto inner1 = outer.createObject("");
+        inner1.addString("feature", "Fabulous New Feature");
+        inner1.addNumber("available", 121);
+        auto users = inner1.createList("users");
+        auto user = users.createObject("user");
+        user.addString("user", "Ben Painter");
+    }
+    toplevel.finish();
+    textstream::Buffer out = std::move(toplevel.sink());
+ * @endcode
+ */
+
+#ifndef __TEXTSTREAM_HPP_INCLUDED
+#define __TEXTSTREAM_HPP_INCLUDED
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include "TextStream.h"
+
+namespace textstream {
+
+/**
+ * Format tokens, the constant parts of each `OutputType`.
+ */
+template <OutputType Format>
+struct Tokens {
+    /** TCL and CSV are not indented */
+    static constexpr bool indent = (Format != TCL) && (Format != CSV);
+    /** JSON and Perl separate items with a comma */
+    static constexpr bool commas = (Format == JSON) || (Format == PERL);
+    /** closing tokens go on their own line */
+    static constexpr bool closeOnNewLine = (Format == JSON) || (Format == PERL) || (Format == XML);
+    static constexpr std::string_view objectOpen =
+        (Format == TCL || Format == JSON || Format == PERL) ? "{" : "";
+    static constexpr std::string_view objectClose =
+        (Format == TCL) ? "} " :
+        (Format == JSON || Format == PERL) ? "}" :
+        (Format == XML) ? "</object>" :
+        (Format == CSV) ? "\n" : "";
+    static constexpr std::string_view listClose =
+        (Format == TCL) ? "}" :
+        (Format == JSON || Format == PERL) ? "]" :
+        (Format == XML) ? "</list>" : "";
+};
+
+/**
+ * Move-only output buffer. `release()` hands the bytes off without a copy.
+ */
+class Buffer {
+public:
+    Buffer() noexcept = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    Buffer(Buffer &&other) noexcept
+        : data_(std::move(other.data_)), size_(other.size_), capacity_(other.capacity_) {
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+    Buffer &operator=(Buffer &&other) noexcept {
+        data_ = std::move(other.data_);
+        size_ = std::exchange(other.size_, 0);
+        capacity_ = std::exchange(other.capacity_, 0);
+        return *this;
+    }
+
+    void append(std::string_view text) {
+        if (size_ + text.size() > capacity_) grow(size_ + text.size());
+        std::memcpy(data_.get() + size_, text.data(), text.size());
+        size_ += text.size();
+    }
+    const char *data() const noexcept { return data_.get(); }
+    std::size_t size() const noexcept { return size_; }
+    std::string_view view() const noexcept { return std::string_view(data_.get(), size_); }
+    /** takes the bytes, `size()` of them, leaving the buffer empty */
+    std::unique_ptr<char[]> release() noexcept {
+        size_ = 0;
+        capacity_ = 0;
+        return std::move(data_);
+    }
+
+private:
+    void grow(std::size_t needed) {
+        std::size_t capacity = (capacity_ > 0) ? capacity_ : 4096;
+        while (capacity < needed) capacity *= 2;
+        std::unique_ptr<char[]> data(new char[capacity]);
+        if (size_ > 0) std::memcpy(data.get(), data_.get(), size_);
+        data_ = std::move(data);
+        capacity_ = capacity;
+    }
+
+    std::unique_ptr<char[]> data_;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+};
+
+/**
+ * Writes straight to a `FILE`, like `newTextUtilStream`. The file is not closed.
+ */
+class FileSink {
+public:
+    explicit FileSink(FILE *output = stdout) noexcept : output_(output) {}
+    void append(std::string_view text) { std::fwrite(text.data(), 1, text.size(), output_); }
+    FILE *output() const noexcept { return output_; }
+
+private:
+    FILE *output_;
+};
+
+template <OutputType Format, class Sink = FileSink>
+class TextStream {
+    using Tok = Tokens<Format>;
+
+    struct Node {
+        const Node *parent;
+        int level;
+        int count;
+        StructType type;
+    };
+
+public:
+    class Object;
+    class List;
+
+    TextStream() = default;
+    explicit TextStream(Sink sink) : sink_(std::move(sink)) {}
+    TextStream(const TextStream &) = delete;
+    TextStream &operator=(const TextStream &) = delete;
+    ~TextStream() { finish(); }
+
+    Object createObject(std::string_view name) { return Object(sink_, root_, name); }
+    List createList(std::string_view name) { return List(sink_, root_, name); }
+    /** ends the document, as `destroy()` on the top level does */
+    void finish() {
+        if (finished_) return;
+        finished_ = true;
+        sink_.append("\n");
+    }
+    Sink &sink() noexcept { return sink_; }
+
+    /**
+     * Shared part of `Object` and `List`. Scopes are neither copied nor
+     * moved, children point at their parent's node.
+     */
+    class Scope {
+    public:
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        Object createObject(std::string_view name) { return Object(*sink_, node_, name); }
+        List createList(std::string_view name) { return List(*sink_, node_, name); }
+        void addNumber(std::string_view name, int number) { addLong(name, number); }
+        void addLong(std::string_view name, long number) {
+            char value[32];
+            auto end = std::to_chars(value, value + sizeof(value), number).ptr;
+            addString(name, std::string_view(value, end - value));
+        }
+        void addString(std::string_view name, std::string_view value) {
+            finishPriorLine(*sink_, node_);
+            spaces(*sink_, node_.level + 1);
+            if (node_.type == ARRAY) listItem(*sink_, value);
+            else objectItem(*sink_, name, value);
+            node_.count++;
+        }
+        bool isOpen() const noexcept { return open_; }
+
+    protected:
+        Scope(Sink &sink, Node &parent, StructType type)
+            : sink_(&sink), node_{&parent, parent.level + 1, 0, type} {
+            finishPriorLine(sink, parent);
+            spaces(sink, parent.level + 1);
+        }
+        ~Scope() = default;
+
+        Sink *sink_;
+        Node node_;
+        bool open_ = true;
+    };
+
+    class Object : public Scope {
+    public:
+        ~Object() { close(); }
+        void close() {
+            if (!this->open_) return;
+            this->open_ = false;
+            Sink &sink = *this->sink_;
+            if constexpr (Tok::closeOnNewLine) {
+                sink.append("\n");
+                spaces(sink, this->node_.level);
+            }
+            sink.append(Tok::objectClose);
+        }
+
+    private:
+        friend class TextStream;
+        friend class Scope;
+        Object(Sink &sink, Node &parent, std::string_view name) : Scope(sink, parent, HASH) {
+            if constexpr (Format == XML) {
+                sink.append("<object name=\"");
+                sink.append(name);
+                sink.append("\">");
+            } else {
+                sink.append(Tok::objectOpen);
+            }
+            parent.count++;
+        }
+    };
+
+    class List : public Scope {
+    public:
+        ~List() { close(); }
+        void close() {
+            if (!this->open_) return;
+            this->open_ = false;
+            Sink &sink = *this->sink_;
+            if constexpr (Tok::closeOnNewLine) {
+                sink.append("\n");
+                spaces(sink, this->node_.level);
+            }
+            sink.append(Tok::listClose);
+        }
+
+    private:
+        friend class TextStream;
+        friend class Scope;
+        List(Sink &sink, Node &parent, std::string_view name) : Scope(sink, parent, ARRAY) {
+            if constexpr (Format == TCL) {
+                if (!name.empty()) { sink.append(name); sink.append(" "); }
+                sink.append("{");
+            } else if constexpr (Format == CSV) {
+                sink.append("\n");
+            } else if constexpr (Format == JSON) {
+                if (!name.empty()) { sink.append("\""); sink.append(name); sink.append("\": "); }
+                sink.append("[");
+            } else if constexpr (Format == XML) {
+                if (!name.empty()) { sink.append("<list name=\""); sink.append(name); sink.append("\">"); }
+                else sink.append("<list>");
+            } else if constexpr (Format == PERL) {
+                if (!name.empty()) { sink.append("'"); sink.append(name); sink.append("' => "); }
+                sink.append("[");
+            }
+            parent.count++;
+        }
+    };
+
+private:
+    static void spaces(Sink &sink, int howmany) {
+        if constexpr (Tok::indent) {
+            static constexpr std::string_view blanks = "                                ";
+            std::size_t left = howmany + 1;
+            while (left > 0) {
+                std::size_t now = (left < blanks.size()) ? left : blanks.size();
+                sink.append(blanks.substr(0, now));
+                left -= now;
+            }
+        }
+    }
+
+    /** the separator `finishPriorLine` writes before a new item */
+    static void finishPriorLine(Sink &sink, const Node &that) {
+        if ((that.level == 0) || (that.parent == nullptr)) return;
+        if constexpr (Tok::commas) {
+            sink.append((that.count > 0) ? ",\n" : "\n");
+        } else if constexpr (Format == TCL) {
+            if (that.count > 0) sink.append(" ");
+        } else if constexpr (Format == CSV) {
+            if ((that.count > 0) && (that.parent->type == UNSET)) sink.append(" ");
+        } else {
+            sink.append("\n");
+        }
+    }
+
+    static void listItem(Sink &sink, std::string_view value) {
+        if constexpr (Format == TCL) {
+            sink.append("{"); sink.append(value); sink.append("} ");
+        } else if constexpr (Format == JSON) {
+            sink.append("\""); sink.append(value); sink.append("\"");
+        } else if constexpr (Format == XML) {
+            sink.append("<item value=\""); sink.append(value); sink.append("\"/>");
+        } else if constexpr (Format == CSV) {
+            sink.append(value); sink.append(",");
+        } else if constexpr (Format == PERL) {
+            sink.append("'"); sink.append(value); sink.append("'");
+        } else {
+            sink.append(value);
+        }
+    }
+
+    static void objectItem(Sink &sink, std::string_view name, std::string_view value) {
+        if constexpr (Format == TCL) {
+            sink.append(name); sink.append(" {"); sink.append(value); sink.append("} ");
+        } else if constexpr (Format == JSON) {
+            sink.append("\""); sink.append(name); sink.append("\": \"");
+            sink.append(value); sink.append("\"");
+        } else if constexpr (Format == XML) {
+            sink.append("<item name=\""); sink.append(name); sink.append("\" value=\"");
+            sink.append(value); sink.append("\"/>");
+        } else if constexpr (Format == CSV) {
+            sink.append(value); sink.append(",");
+        } else if constexpr (Format == PERL) {
+            sink.append("'"); sink.append(name); sink.append("' => '");
+            sink.append(value); sink.append("'");
+        } else {
+            sink.append(name); sink.append(" = "); sink.append(value);
+        }
+    }
+
+    Sink sink_;
+    Node root_{nullptr, 0, 0, UNSET};
+    bool finished_ = false;
+};
+
+/**
+ * test helper, the bytes TextStream.c writes for the test document.
+ */
+inline Buffer testDocumentC(OutputType otype) {
+    Buffer out;
+    char *text = nullptr;
+    std::size_t length = 0;
+    FILE *output = open_memstream(&text, &length);
+    if (output == nullptr) return out;
+    TextUtilStream *toplevel = newTextUtilStream(output, otype);
+    TextUtilStream *outer = createList(toplevel, (char *) "");
+    TextUtilStream *inner = createObject(outer, (char *) "");
+    addString(inner, (char *) "feature", (char *) "Fabulous New Feature");
+    addNumber(inner, (char *) "available", 121);
+    TextUtilStream *users = createList(inner, (char *) "users");
+    TextUtilStream *user = createObject(users, (char *) "user");
+    addString(user, (char *) "user", (char *) "Ben Painter");
+    addLong(user, (char *) "number", -10);
+    destroy(user);
+    addString(users, (char *) "", (char *) "guest");
+    destroy(users);
+    addString(inner, (char *) "empty", (char *) "");
+    destroy(inner);
+    inner = createObject(outer, (char *) "");
+    addString(inner, (char *) "foo", (char *) "bar");
+    destroy(inner);
+    destroy(outer);
+    destroy(toplevel);
+    std::fclose(output);
+    out.append(std::string_view(text, length));
+    std::free(text);
+    return out;
+}
+
+/**
+ * test helper, the same document written with `TextStream<Format>`.
+ */
+template <OutputType Format>
+Buffer testDocumentCpp() {
+    TextStream<Format, Buffer> toplevel;
+    {
+        auto outer = toplevel.createList("");
+        {
+            auto inner = outer.createObject("");
+            inner.addString("feature", "Fabulous New Feature");
+            inner.addNumber("available", 121);
+            {
+                auto users = inner.createList("users");
+                {
+                    auto user = users.createObject("user");
+                    user.addString("user", "Ben Painter");
+                    user.addLong("number", -10);
+                }
+                users.addString("", "guest");
+            }
+            inner.addString("empty", "");
+        }
+        auto inner = outer.createObject("");
+        inner.addString("foo", "bar");
+    }
+    toplevel.finish();
+    return std::move(toplevel.sink());
+}
+
+template <OutputType Format>
+int testSameAsC() {
+    Buffer expected = testDocumentC(Format);
+    Buffer got = testDocumentCpp<Format>();
+    if (expected.view() == got.view()) return 0;
+    std::fprintf(stderr, "testTextStream: output type %d differs from TextStream.c\nexpected:\n%.*s\ngot:\n%.*s\n",
+                 (int) Format, (int) expected.size(), expected.data(), (int) got.size(), got.data());
+    return 1;
+}
+
+/**
+ * checks that every format writes the same bytes as TextStream.c, which
+ * has to be linked in. Returns 0 when they all match.
+ */
+inline int testTextStream() {
+    return testSameAsC<STRING>() | testSameAsC<TCL>() | testSameAsC<SH>() | testSameAsC<PS>() |
+           testSameAsC<BAT>() | testSameAsC<PERL>() | testSameAsC<JSON>() | testSameAsC<XML>() |
+           testSameAsC<CSV>();
+}
+
+} // namespace textstream
+#endif
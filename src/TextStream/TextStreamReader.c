@@ -0,0 +1,583 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef __TEXTSTREAMREADER_INCLUDED
+#include "TextStreamReader.h"
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+ /**
+  * @file TextStreamReader.c
+  * @brief pull parser and transcoder for TextStream output
+  * @author thepainters@gmail.com
+  */
+
+/**
+ * @file textstreamreader.c
+ * @brief Reads JSON, Tcl, Perl and CSV written by TextStream.
+ *
+ * Events point into the input, nothing is copied or allocated while
+ * parsing. TextStream does not escape values, so neither does the reader.
+ * In Tcl an empty object in a list is written just like an empty value,
+ * and is read back as one; the text written out again is the same.
+ * ## Example
+ * @code
+    TextUtilReader *in = openTextUtilReader("status.json", JSON);
+    TextUtilStream *toplevel = newTextUtilStream(stdout, XML);
+    transcodeTextUtil(in, toplevel);
+    destroy(toplevel);
+    closeTextUtilReader(in);
+ * @endcode
+ */
+
+/**
+ * creates a reader over `size` bytes of `text`, which must outlive it.
+ */
+TextUtilReader *newTextUtilReader(const char *text, size_t size, OutputType itype) {
+    TextUtilReader *that = NULL;
+    that = (TextUtilReader *) mobjalloc(sizeof(TextUtilReader));
+    that->base = text;
+    that->size = size;
+    that->pos = 0;
+    that->itype = itype;
+    that->depth = 0;
+    that->mapped = 0;
+    return that;
+}
+/**
+ * creates a reader over a file, which is mapped rather than read.
+ */
+TextUtilReader *openTextUtilReader(char *path, OutputType itype) {
+    TextUtilReader *that = NULL;
+    struct stat info;
+    void *base = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return newTextUtilReader("", 0, itype);
+    }
+    base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+    madvise(base, info.st_size, MADV_SEQUENTIAL);
+    that = newTextUtilReader((const char *) base, info.st_size, itype);
+    that->mapped = 1;
+    return that;
+}
+void closeTextUtilReader(TextUtilReader *that) {
+    if (that == NULL) return;
+    if (that->mapped) munmap((void *) that->base, that->size);
+    mfree(that);
+}
+
+/*
+ * skips blanks, and for JSON and Perl the commas between items.
+ */
+void skipBlanks(TextUtilReader *that) {
+    char c;
+    while (that->pos < that->size) {
+        c = that->base[that->pos];
+        if ((c == ',') && ((that->itype == JSON) || (that->itype == PERL))) {
+            that->pos++;
+            continue;
+        }
+        if ((c != ' ') && (c != '\t') && (c != '\r') && (c != '\n')) return;
+        that->pos++;
+    }
+}
+/*
+ * sets `event` and returns its type.
+ */
+TextEventType setEvent(TextEvent *event, TextEventType type, const char *name, size_t namelen,
+                       const char *value, size_t valuelen) {
+    event->type = type;
+    event->name.ptr = name;
+    event->name.len = namelen;
+    event->value.ptr = value;
+    event->value.len = valuelen;
+    return type;
+}
+/*
+ * enters an object or list.
+ */
+TextEventType openEvent(TextUtilReader *that, TextEvent *event, StructType type,
+                        const char *name, size_t namelen) {
+    if (that->depth >= TEXTREADER_MAXDEPTH) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    that->stack[that->depth++] = type;
+    return setEvent(event, (type == HASH) ? TEXT_OBJECT : TEXT_LIST, name, namelen, NULL, 0);
+}
+/*
+ * leaves the current object or list, which must be of `type`.
+ */
+TextEventType closeEvent(TextUtilReader *that, TextEvent *event, StructType type) {
+    that->pos++;
+    if ((that->depth == 0) || (that->stack[that->depth - 1] != type)) {
+        return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    }
+    that->depth--;
+    return setEvent(event, (type == HASH) ? TEXT_CLOSE_OBJECT : TEXT_CLOSE_LIST, NULL, 0, NULL, 0);
+}
+/*
+ * reads a quoted string, leaving `pos` after the closing quote.
+ */
+int readQuoted(TextUtilReader *that, TextSpan *span) {
+    char quote = that->base[that->pos++];
+    size_t start = that->pos;
+    while (that->pos < that->size) {
+        if (that->base[that->pos] == '\\') that->pos++;
+        else if (that->base[that->pos] == quote) break;
+        that->pos++;
+    }
+    if (that->pos >= that->size) return 0;
+    span->ptr = that->base + start;
+    span->len = that->pos - start;
+    that->pos++;
+    return 1;
+}
+/*
+ * reads an unquoted JSON or Perl token such as a number.
+ */
+void readBare(TextUtilReader *that, TextSpan *span) {
+    size_t start = that->pos;
+    char c;
+    while (that->pos < that->size) {
+        c = that->base[that->pos];
+        if ((c == ',') || (c == '}') || (c == ']') || (c == ':') || (c == '=')) break;
+        if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) break;
+        that->pos++;
+    }
+    span->ptr = that->base + start;
+    span->len = that->pos - start;
+}
+
+/*
+ * JSON and Perl: `"name": "value"` and `'name' => 'value'`.
+ */
+TextEventType nextQuotedEvent(TextUtilReader *that, TextEvent *event) {
+    TextSpan name = {NULL, 0};
+    TextSpan value = {NULL, 0};
+    char c;
+    skipBlanks(that);
+    if (that->pos >= that->size) {
+        return setEvent(event, (that->depth == 0) ? TEXT_END : TEXT_ERROR, NULL, 0, NULL, 0);
+    }
+    c = that->base[that->pos];
+    if (c == '}') return closeEvent(that, event, HASH);
+    if (c == ']') return closeEvent(that, event, ARRAY);
+    if ((that->depth > 0) && (that->stack[that->depth - 1] == HASH) && (c != '{') && (c != '[')) {
+        if ((c == '"') || (c == '\'')) {
+            if (! readQuoted(that, &name)) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+        } else {
+            readBare(that, &name);
+        }
+        skipBlanks(that);
+        if ((that->pos < that->size) && (that->base[that->pos] == ':')) that->pos++;
+        else if ((that->pos + 1 < that->size) && (that->base[that->pos] == '=') &&
+                 (that->base[that->pos + 1] == '>')) that->pos += 2;
+        else return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+        skipBlanks(that);
+        if (that->pos >= that->size) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+        c = that->base[that->pos];
+    }
+    if (c == '{') {
+        that->pos++;
+        return openEvent(that, event, HASH, name.ptr, name.len);
+    }
+    if (c == '[') {
+        that->pos++;
+        return openEvent(that, event, ARRAY, name.ptr, name.len);
+    }
+    if ((c == '"') || (c == '\'')) {
+        if (! readQuoted(that, &value)) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    } else {
+        readBare(that, &value);
+        if (value.len == 0) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    }
+    return setEvent(event, TEXT_VALUE, name.ptr, name.len, value.ptr, value.len);
+}
+
+/*
+ * finds the brace closing the one at `open`, or returns 0.
+ * Sets `nested` if there are braces inside.
+ */
+size_t matchBrace(TextUtilReader *that, size_t open, int *nested) {
+    size_t pos = open + 1;
+    int depth = 1;
+    *nested = 0;
+    for (; pos < that->size; pos++) {
+        if (that->base[pos] == '{') {
+            depth++;
+            *nested = 1;
+        } else if (that->base[pos] == '}') {
+            if (--depth == 0) return pos;
+        }
+    }
+    return 0;
+}
+/*
+ * Tcl: an empty `{}` closing a list is followed by no blank, or by one
+ * before the next item. An object or a value always adds a blank of its own.
+ */
+int closesTclList(TextUtilReader *that, size_t close) {
+    size_t pos = close + 1;
+    size_t blanks = 0;
+    while ((pos < that->size) && (that->base[pos] == ' ')) {
+        pos++;
+        blanks++;
+    }
+    if ((pos >= that->size) || (that->base[pos] == '}') || (that->base[pos] == '\n')) return (blanks == 0);
+    return (blanks == 1);
+}
+/*
+ * Tcl: a `{` starts a list when its first item is braced, an object
+ * when it holds braces after a name, and is a value otherwise. An empty
+ * `{}` is a list or object when its spacing or place says so.
+ */
+TextEventType nextTclGroup(TextUtilReader *that, TextEvent *event, const char *name, size_t namelen) {
+    size_t open = that->pos;
+    size_t first = open + 1;
+    size_t close = 0;
+    int nested = 0;
+    while ((first < that->size) && (that->base[first] == ' ')) first++;
+    close = matchBrace(that, open, &nested);
+    if (close == 0) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    if (first == close) {
+        if (closesTclList(that, close)) {
+            that->pos = open + 1;
+            return openEvent(that, event, ARRAY, name, namelen);
+        }
+        if ((namelen == 0) && ((that->depth == 0) || (that->stack[that->depth - 1] == HASH))) {
+            /* only a list item has no name, so this is an empty object */
+            that->pos = open + 1;
+            return openEvent(that, event, HASH, name, namelen);
+        }
+    }
+    if ((first < close) && (that->base[first] == '{')) {
+        that->pos = open + 1;
+        return openEvent(that, event, ARRAY, name, namelen);
+    }
+    if (nested && (namelen == 0)) {
+        that->pos = open + 1;
+        return openEvent(that, event, HASH, name, namelen);
+    }
+    that->pos = close + 1;
+    return setEvent(event, TEXT_VALUE, name, namelen, that->base + open + 1, close - open - 1);
+}
+TextEventType nextTclEvent(TextUtilReader *that, TextEvent *event) {
+    size_t start = 0;
+    size_t namelen = 0;
+    char c;
+    skipBlanks(that);
+    if (that->pos >= that->size) {
+        return setEvent(event, (that->depth == 0) ? TEXT_END : TEXT_ERROR, NULL, 0, NULL, 0);
+    }
+    c = that->base[that->pos];
+    if (c == '}') {
+        if (that->depth == 0) return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+        return closeEvent(that, event, that->stack[that->depth - 1]);
+    }
+    if (c == '{') return nextTclGroup(that, event, NULL, 0);
+    /* a name, then its braced value or list */
+    start = that->pos;
+    while ((that->pos < that->size) && (that->base[that->pos] != '{')) {
+        c = that->base[that->pos];
+        if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) break;
+        that->pos++;
+    }
+    namelen = that->pos - start;
+    skipBlanks(that);
+    if ((that->pos >= that->size) || (that->base[that->pos] != '{')) {
+        return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+    }
+    return nextTclGroup(that, event, that->base + start, namelen);
+}
+
+/*
+ * CSV: every line is an object of unnamed values, all in one list.
+ */
+TextEventType nextCsvEvent(TextUtilReader *that, TextEvent *event) {
+    size_t start = 0;
+    char c;
+    if (that->depth == 0) {
+        if (that->pos > 0) return setEvent(event, TEXT_END, NULL, 0, NULL, 0);
+        return openEvent(that, event, ARRAY, NULL, 0);
+    }
+    if (that->depth == 1) {
+        while ((that->pos < that->size) &&
+               ((that->base[that->pos] == '\n') || (that->base[that->pos] == '\r'))) that->pos++;
+        if (that->pos >= that->size) {
+            /* past the end, so the next call returns TEXT_END */
+            that->depth = 0;
+            that->pos = that->size + 1;
+            return setEvent(event, TEXT_CLOSE_LIST, NULL, 0, NULL, 0);
+        }
+        return openEvent(that, event, HASH, NULL, 0);
+    }
+    if ((that->pos >= that->size) || (that->base[that->pos] == '\n') || (that->base[that->pos] == '\r')) {
+        that->depth--;
+        return setEvent(event, TEXT_CLOSE_OBJECT, NULL, 0, NULL, 0);
+    }
+    start = that->pos;
+    while (that->pos < that->size) {
+        c = that->base[that->pos];
+        if ((c == ',') || (c == '\n') || (c == '\r')) break;
+        that->pos++;
+    }
+    setEvent(event, TEXT_VALUE, NULL, 0, that->base + start, that->pos - start);
+    if ((that->pos < that->size) && (that->base[that->pos] == ',')) that->pos++;
+    return TEXT_VALUE;
+}
+
+/**
+ * reads the next event. The spans in `event` point into the input.
+ */
+TextEventType nextTextEvent(TextUtilReader *that, TextEvent *event) {
+    if ((that == NULL) || (event == NULL)) return TEXT_ERROR;
+    switch (that->itype) {
+        case JSON:
+        case PERL:
+            return nextQuotedEvent(that, event);
+        case TCL:
+            return nextTclEvent(that, event);
+        case CSV:
+            return nextCsvEvent(that, event);
+        default:
+            break;
+    }
+    return setEvent(event, TEXT_ERROR, NULL, 0, NULL, 0);
+}
+
+/*
+ * copies a span into `*scratch`, growing it as needed, for the
+ * TextUtilStream calls that take NUL terminated strings.
+ */
+char *spanString(TextSpan *span, char **scratch, size_t *size) {
+    if (span->len + 1 > *size) {
+        if (*scratch != NULL) mfree(*scratch);
+        *size = span->len + 1;
+        mstralloc(*scratch, *size);
+    }
+    if (span->len > 0) memcpy(*scratch, span->ptr, span->len);
+    (*scratch)[span->len] = '\0';
+    return *scratch;
+}
+/**
+ * replays every event of `in` into `out` with `createObject`, `createList`
+ * and `addString`. Returns 0, or -1 if the input is not well formed.
+ */
+int transcodeTextUtil(TextUtilReader *in, TextUtilStream *out) {
+    TextUtilStream *stack[TEXTREADER_MAXDEPTH + 1];
+    TextEvent event;
+    TextEventType type;
+    char *name = NULL;
+    char *value = NULL;
+    size_t namesize = 0;
+    size_t valuesize = 0;
+    int depth = 0;
+    int status = 0;
+    if ((in == NULL) || (out == NULL)) return -1;
+    stack[0] = out;
+    while ((type = nextTextEvent(in, &event)) != TEXT_END) {
+        if (type == TEXT_ERROR) {
+            status = -1;
+            break;
+        }
+        switch (type) {
+            case TEXT_OBJECT:
+                stack[depth + 1] = createObject(stack[depth], spanString(&event.name, &name, &namesize));
+                depth++;
+                break;
+            case TEXT_LIST:
+                stack[depth + 1] = createList(stack[depth], spanString(&event.name, &name, &namesize));
+                depth++;
+                break;
+            case TEXT_VALUE:
+                addString(stack[depth], spanString(&event.name, &name, &namesize),
+                          spanString(&event.value, &value, &valuesize));
+                break;
+            case TEXT_CLOSE_OBJECT:
+            case TEXT_CLOSE_LIST:
+                if (depth > 0) destroy(stack[depth--]);
+                break;
+            default:
+                break;
+        }
+    }
+    while (depth > 0) destroy(stack[depth--]);
+    if (name != NULL) mfree(name);
+    if (value != NULL) mfree(value);
+    return status;
+}
+
+typedef struct {
+  const char *base;
+  size_t size;
+  OutputType itype;
+  OutputType otype;
+  char *text;
+  size_t length;
+  int status;
+} TranscodeChunk;
+
+void *transcodeChunk(void *arg) {
+    TranscodeChunk *chunk = (TranscodeChunk *) arg;
+    TextUtilReader *in = newTextUtilReader(chunk->base, chunk->size, chunk->itype);
+    FILE *output = open_memstream(&chunk->text, &chunk->length);
+    TextUtilStream *toplevel = NULL;
+    if (output == NULL) {
+        chunk->status = -1;
+        closeTextUtilReader(in);
+        return NULL;
+    }
+    toplevel = newRecordTextUtilStream(output, chunk->otype);
+    chunk->status = transcodeTextUtil(in, toplevel);
+    destroy(toplevel);
+    fclose(output);
+    closeTextUtilReader(in);
+    return NULL;
+}
+/**
+ * transcodes a file of records, one per line, such as CSV rows or the
+ * output of `newRecordTextUtilStream`, into records of `otype`.
+ *
+ * The file is split at line ends and the parts are transcoded by up to
+ * `threads` threads. Each part is held in memory until it is written,
+ * in order, to `output`. Returns 0, or -1 if any part failed.
+ */
+int transcodeTextUtilRecords(char *path, OutputType itype, FILE *output, OutputType otype, int threads) {
+    TextUtilReader *in = openTextUtilReader(path, itype);
+    TranscodeChunk *chunks = NULL;
+    pthread_t *workers = NULL;
+    TextUtilStream *toplevel = NULL;
+    const char *end = NULL;
+    size_t start = 0;
+    size_t stop = 0;
+    int started = 0;
+    int status = 0;
+    int i = 0;
+    if (in == NULL) return -1;
+    if ((threads <= 1) || (in->size < (size_t) threads * 65536)) {
+        toplevel = newRecordTextUtilStream(output, otype);
+        status = transcodeTextUtil(in, toplevel);
+        destroy(toplevel);
+        closeTextUtilReader(in);
+        return status;
+    }
+    chunks = (TranscodeChunk *) mobjalloc(threads * sizeof(TranscodeChunk));
+    workers = (pthread_t *) mobjalloc(threads * sizeof(pthread_t));
+    for (i = 0; (i < threads) && (start < in->size); i++) {
+        stop = (i == threads - 1) ? in->size : start + (in->size / threads);
+        if (stop < in->size) {
+            end = memchr(in->base + stop, '\n', in->size - stop);
+            stop = (end == NULL) ? in->size : (size_t) (end - in->base) + 1;
+        }
+        chunks[i].base = in->base + start;
+        chunks[i].size = stop - start;
+        chunks[i].itype = itype;
+        chunks[i].otype = otype;
+        chunks[i].text = NULL;
+        chunks[i].length = 0;
+        chunks[i].status = 0;
+        if (pthread_create(&workers[i], NULL, transcodeChunk, &chunks[i]) != 0) {
+            transcodeChunk(&chunks[i]);
+            workers[i] = pthread_self();
+        }
+        start = stop;
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        if (! pthread_equal(workers[i], pthread_self())) pthread_join(workers[i], NULL);
+        if (chunks[i].status != 0) status = -1;
+        if (chunks[i].text != NULL) {
+            fwrite(chunks[i].text, 1, chunks[i].length, output);
+            free(chunks[i].text);
+        }
+    }
+    fflush(output);
+    mfree(chunks);
+    mfree(workers);
+    closeTextUtilReader(in);
+    return status;
+}
+
+/*
+ * test helper, writes a document with empty objects, lists and values.
+ */
+void writeTestReaderDocument(TextUtilStream *toplevel) {
+    TextUtilStream *outer, *obj, *users, *user, *empty;
+    outer = createList(toplevel, "");
+    obj = createObject(outer, "");
+    addString(obj, "foo", "bar");
+    empty = createList(obj, "");
+    destroy(empty);
+    empty = createObject(obj, "");
+    destroy(empty);
+    addString(obj, "blank", "");
+    empty = createList(obj, "none");
+    destroy(empty);
+    users = createList(obj, "users");
+    user = createObject(users, "user");
+    addString(user, "user", "Ben Painter");
+    addNumber(user, "number", 10);
+    destroy(user);
+    empty = createList(users, "");
+    destroy(empty);
+    addString(users, "", "guest");
+    empty = createObject(users, "");
+    destroy(empty);
+    destroy(users);
+    empty = createObject(obj, "");
+    destroy(empty);
+    destroy(obj);
+    obj = createObject(outer, "");
+    destroy(obj);
+    empty = createList(outer, "");
+    destroy(empty);
+    destroy(outer);
+    destroy(toplevel);
+}
+/**
+ * checks that JSON, Perl and Tcl documents, empty objects and lists
+ * included, read back and write out again byte for byte.
+ */
+int testTextUtilReader(int argc, char *argv[]) {
+    OutputType types[] = {JSON, PERL, TCL};
+    TextUtilReader *in = NULL;
+    TextUtilStream *toplevel = NULL;
+    FILE *output = NULL;
+    char *text = NULL, *again = NULL;
+    size_t length = 0, againlength = 0;
+    int status = 0;
+    int i = 0;
+    for (i = 0; i < (int) (sizeof(types) / sizeof(types[0])); i++) {
+        output = open_memstream(&text, &length);
+        if (output == NULL) return 1;
+        writeTestReaderDocument(newTextUtilStream(output, types[i]));
+        fclose(output);
+        output = open_memstream(&again, &againlength);
+        if (output == NULL) return 1;
+        in = newTextUtilReader(text, length, types[i]);
+        toplevel = newTextUtilStream(output, types[i]);
+        if (transcodeTextUtil(in, toplevel) != 0) status = 1;
+        destroy(toplevel);
+        closeTextUtilReader(in);
+        fclose(output);
+        if ((length != againlength) || (memcmp(text, again, length) != 0)) {
+            fprintf(stderr, "testTextUtilReader: output type %d differs\nexpected:\n%s\ngot:\n%s\n",
+                    types[i], text, again);
+            status = 1;
+        }
+        free(text);
+        free(again);
+    }
+    return status;
+}
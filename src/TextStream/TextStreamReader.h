@@ -0,0 +1,66 @@
+
+ /**
+  * @file TextStreamReader.h
+  * @brief reads TextStream output back as name/value events
+  * @author thepainters@gmail.com
+  */
+
+#ifndef __TEXTSTREAMREADER_INCLUDED
+#define __TEXTSTREAMREADER_INCLUDED
+#include <stddef.h>
+#include "TextStream.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXTREADER_MAXDEPTH 64
+
+/**
+ * Text inside the input; it is not NUL terminated.
+ */
+typedef struct {
+  const char *ptr;
+  size_t len;
+} TextSpan;
+
+typedef enum {
+  /** end of input */
+    TEXT_END = 0,
+  /** an object starts, `name` may be empty */
+    TEXT_OBJECT,
+  /** a list starts, `name` may be empty */
+    TEXT_LIST,
+  /** a name/value pair, or a list item with an empty `name` */
+    TEXT_VALUE,
+    TEXT_CLOSE_OBJECT,
+    TEXT_CLOSE_LIST,
+  /** the input is not in the expected format */
+    TEXT_ERROR
+} TextEventType;
+
+typedef struct {
+  TextEventType type;
+  TextSpan name;
+  TextSpan value;
+} TextEvent;
+
+typedef struct textUtilReader {
+  const char *base;
+  size_t size;
+  size_t pos;
+  OutputType itype;
+  int depth;
+  StructType stack[TEXTREADER_MAXDEPTH];
+  int mapped;
+} TextUtilReader;
+
+TextUtilReader *newTextUtilReader(const char *, size_t, OutputType);
+TextUtilReader *openTextUtilReader(char *, OutputType);
+TextEventType nextTextEvent(TextUtilReader *, TextEvent *);
+void closeTextUtilReader(TextUtilReader *);
+int transcodeTextUtil(TextUtilReader *, TextUtilStream *);
+int transcodeTextUtilRecords(char *, OutputType, FILE *, OutputType, int);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,353 @@
+
+ /**
+  * @file apitrace-bench.c
+  * @brief measures what API_TRACE costs
+  * @author thepainters@gmail.com
+  */
+
+/**
+ * Times one API_TRACE_FROM_FILE call site with tracing compiled out,
+ * compiled in but off, on to /dev/null and on to a file, then on to a
+ * shared file from 1 to N threads. Built with API_TRACE_STRUCTURED, it
+ * also times an API_TRACE_EVENT call site, off and on to a file as JSON
+ * Lines, and with API_TRACE_SHM, the trace on to a shared memory ring. For each it prints ns/call and the
+ * read and write system calls per call, counted from /proc/self/io.
+ * Build it once per tracing mode to compare them:
+ * @code
+ *   cc -O2 -o apitrace-bench apitrace-bench.c -lpthread
+ *   cc -O2 -DAPI_TRACE_DYNAMIC -o apitrace-bench-dynamic apitrace-bench.c -lpthread
+ *   cc -O2 -DAPI_TRACE_SHM -o apitrace-bench-shm apitrace-bench.c -lpthread -lrt
+ *   cc -O2 -DAPI_TRACE_STRUCTURED -I../TextStream -include alloc.h -o apitrace-bench-structured \
+ *       apitrace-bench.c ../TextStream/TextStream.c ../TextStream/TextStreamReader.c -lpthread
+ *   apitrace-bench [-n calls] [-t threads]
+ * @endcode
+ * The structured build needs the header that defines the allocation
+ * macros TextStream.c uses (mobjalloc, mfree, mstrdup, mstralloc, NSTR
+ * and str_append). It is not part of this tree; `alloc.h` above stands
+ * for it, and -include puts it ahead of everything else.
+ * Exits 1 if tracing that is off makes any system call, built with
+ * API_TRACE_DYNAMIC, if a query turns on other call sites than it names
+ * or call sites left on do not fall back to stderr once the trace is
+ * closed, or, built with API_TRACE_STRUCTURED, if events written as JSON
+ * Lines do not parse back to the values given, so it can be run as a
+ * regression check.
+ */
+#include "apitrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+API_TRACING_INIT(bench)
+
+#define BENCH_TRACE_OUT(API, fmt, ...) do { } while (0)
+
+static volatile long bench_sink = 0;
+
+static void __attribute__((noinline)) call_compiled_out(long i) {
+    BENCH_TRACE_OUT(bench, "call %ld", i);
+    bench_sink += i;
+}
+
+static void __attribute__((noinline)) call_traced(long i) {
+    API_TRACE_FROM_FILE(bench, "call %ld", i);
+    bench_sink += i;
+}
+
+#if defined(API_TRACE_STRUCTURED) && !defined(PC)
+#include "../TextStream/TextStreamReader.h"
+
+/*
+ * decodes the JSON string in `span` into `out`, which holds as many bytes.
+ */
+static char *json_string(TextSpan *span, char *out) {
+    const char *in = span->ptr;
+    const char *end = span->ptr + span->len;
+    char *to = out;
+    unsigned int code = 0;
+    for (; in < end; in++) {
+        if ((*in != '\\') || (in + 1 >= end)) {
+            *to++ = *in;
+            continue;
+        }
+        switch (*++in) {
+            case 'n': *to++ = '\n'; break;
+            case 'r': *to++ = '\r'; break;
+            case 't': *to++ = '\t'; break;
+            case 'u':
+                if ((in + 4 < end) && (sscanf(in + 1, "%4x", &code) == 1)) *to++ = (char) code;
+                in += 4;
+                break;
+            default: *to++ = *in; break;
+        }
+    }
+    *to = '\0';
+    return out;
+}
+
+/*
+ * writes an event whose values need escaping as JSON Lines, and checks
+ * that it parses back to the same values. Returns the number of errors.
+ */
+static int check_events(void) {
+    char *names[] = {"message", "path", "multi", "brace"};
+    char *values[] = {"open \"C:\\tmp\" failed", "a<b&c,d", "line1\nline2\ttab\x01", "{x} 'q'"};
+    TextUtilReader *in = NULL;
+    TextEvent event;
+    TextEventType type;
+    FILE *memory = NULL;
+    char *text = NULL;
+    char got[256];
+    size_t length = 0;
+    int errors = 0;
+    int found = 0;
+    int i = 0;
+    memory = open_memstream(&text, &length);
+    if (memory == NULL) return 1;
+    bench_TRACING_STREAM = memory;
+    bench_trace_format(JSON);
+    bench_trace_set(1);
+    API_TRACE_EVENT(bench, values[0], names[1], values[1], names[2], values[2], names[3], values[3]);
+    bench_trace_events_flush();
+    bench_trace_set(0);
+    bench_trace_format(-1);
+    bench_TRACING_STREAM = NULL;
+    fclose(memory);
+    if ((length == 0) || (memchr(text, '\n', length) != text + length - 1)) errors++;
+    in = newTextUtilReader(text, length, JSON);
+    if (nextTextEvent(in, &event) != TEXT_OBJECT) errors++;
+    while ((type = nextTextEvent(in, &event)) == TEXT_VALUE) {
+        if (event.value.len >= sizeof(got)) continue;
+        for (i = 0; i < 4; i++) {
+            if ((event.name.len != strlen(names[i])) || (strncmp(event.name.ptr, names[i], event.name.len) != 0)) continue;
+            found++;
+            if (strcmp(json_string(&event.value, got), values[i]) != 0) errors++;
+        }
+    }
+    if ((type != TEXT_CLOSE_OBJECT) || (nextTextEvent(in, &event) != TEXT_END) || (found != 4)) errors++;
+    if (errors > 0) fprintf(stderr, "event does not parse back:\n%s", text);
+    closeTextUtilReader(in);
+    free(text);
+    return errors;
+}
+#endif
+
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+#include <fcntl.h>
+/*
+ * checks that a query turns on only the call sites it names, and that
+ * call sites left on trace to stderr once the trace is closed. Returns
+ * the number of errors.
+ */
+static int check_sites(void) {
+    int errors = 0;
+    int saved = -1;
+    int null = -1;
+    if (bench_trace_control("func=call_traced;") != 1) errors++;
+    if (bench_trace_control(";-func=call_traced") != 1) errors++;
+    saved = dup(2);
+    null = open("/dev/null", O_WRONLY);
+    if ((saved < 0) || (null < 0)) return errors + 1;
+    bench_trace_file("/dev/null");
+    bench_trace_set(1);
+    API_TRACING_STOP(bench);
+    fflush(stderr);
+    dup2(null, 2);
+    call_traced(0);
+    fflush(stderr);
+    dup2(saved, 2);
+    close(null);
+    close(saved);
+    bench_trace_set(0);
+    if (bench_TRACING_STREAM != stderr) errors++;
+    return errors;
+}
+#endif
+
+#if defined(API_TRACE_STRUCTURED) && !defined(PC)
+static void __attribute__((noinline)) call_event(long i) {
+    API_TRACE_EVENT(bench, "call", "name", "value");
+    bench_sink += i;
+}
+#endif
+
+static double now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double) now.tv_sec * 1e9) + now.tv_nsec;
+}
+
+static long syscalls_probe = 0;
+static long syscalls_overhead = 0;
+
+/*
+ * read and write system calls made so far by the process, or -1, less
+ * the ones it makes itself to find out.
+ */
+static long syscalls(void) {
+    char line[128];
+    long total = 0;
+    long value = 0;
+    int found = 0;
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == NULL) return -1;
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if ((sscanf(line, "syscr: %ld", &value) == 1) || (sscanf(line, "syscw: %ld", &value) == 1)) {
+            total += value;
+            found++;
+        }
+    }
+    fclose(io);
+    if (found != 2) return -1;
+    syscalls_probe++;
+    return total - (syscalls_probe * syscalls_overhead);
+}
+
+typedef struct {
+    void (*call)(long);
+    long calls;
+} BenchRun;
+
+static void *run(void *arg) {
+    BenchRun *that = (BenchRun *) arg;
+    long i = 0;
+    for (i = 0; i < that->calls; i++) that->call(i);
+    return NULL;
+}
+
+/*
+ * runs `calls` calls on each of `threads` threads, and prints a line; with
+ * `base`, also the throughput relative to the first run given it. Returns
+ * the system calls per call.
+ */
+static double measure(char *name, void (*call)(long), long calls, int threads, double *base) {
+    pthread_t workers[256];
+    BenchRun job;
+    double start = 0, elapsed = 0, percall = 0, rate = 0;
+    long before = 0, after = 0;
+    int started = 0;
+    int i = 0;
+    job.call = call;
+    job.calls = calls;
+    before = syscalls();
+    start = now_ns();
+    if (threads <= 1) {
+        run(&job);
+    } else {
+        for (i = 0; i < threads; i++) {
+            if (pthread_create(&workers[started], NULL, run, &job) == 0) started++;
+        }
+        for (i = 0; i < started; i++) pthread_join(workers[i], NULL);
+        if (started < threads) fprintf(stderr, "%s: only %d of %d threads started\n", name, started, threads);
+        threads = started;
+        if (threads == 0) {
+            run(&job);
+            threads = 1;
+        }
+    }
+    elapsed = now_ns() - start;
+    after = syscalls();
+    percall = ((before < 0) || (after < 0)) ? -1 : (double) (after - before) / ((double) calls * threads);
+    rate = ((double) calls * threads) / (elapsed / 1e9);
+    printf("%-28s %8d %12ld %10.1f %14.2f", name, threads, calls * threads,
+           elapsed / ((double) calls * threads), percall);
+    if (base != NULL) {
+        if (*base == 0) *base = rate;
+        printf(" %9.2fx", rate / *base);
+    }
+    printf("\n");
+    return percall;
+}
+
+int main(int argc, char *argv[]) {
+    char path[1024];
+    char *dir = getenv("TMPDIR");
+    double base = 0, percall = 0;
+    long probe = 0;
+    long calls = 200000;
+    int maxthreads = 8;
+    int status = 0;
+    int opt = 0;
+    int i = 0;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+            case 'n': calls = atol(optarg); break;
+            case 't': maxthreads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n calls] [-t threads]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (maxthreads > 256) maxthreads = 256;
+    if ((dir == NULL) || (strlen(dir) == 0)) dir = "/tmp";
+    snprintf(path, sizeof(path), "%s/apitrace-bench.%ld", dir, (long) getpid());
+    unsetenv("bench_TRACE");
+    unsetenv("bench_TRACING");
+    unsetenv("bench_TRACING_FILE");
+    unsetenv("bench_TRACING_SHM");
+    unsetenv("bench_TRACING_SITES");
+    probe = syscalls();
+    if (probe >= 0) syscalls_overhead = syscalls() - probe;
+
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+    if (check_sites() != 0) status = 1;
+#endif
+#if defined(API_TRACE_STRUCTURED) && !defined(PC)
+    if (check_events() != 0) status = 1;
+#endif
+
+    printf("%-28s %8s %12s %10s %14s\n", "case", "threads", "calls", "ns/call", "syscalls/call");
+    measure("compiled out", call_compiled_out, calls, 1, NULL);
+
+    bench_trace_set(0);
+    percall = measure("compiled in, off", call_traced, calls, 1, NULL);
+    if (percall > 0) {
+        fprintf(stderr, "%s: tracing that is off made system calls\n", argv[0]);
+        status = 1;
+    }
+
+    bench_trace_file("/dev/null");
+    bench_trace_set(1);
+    measure("on, /dev/null", call_traced, calls, 1, NULL);
+    bench_trace_close();
+
+    bench_trace_file(path);
+    bench_trace_set(1);
+    measure("on, file", call_traced, calls, 1, NULL);
+    bench_trace_close();
+
+#if defined(API_TRACE_SHM) && !defined(PC)
+    char name[64];
+    snprintf(name, sizeof(name), "/apitrace-bench.%ld", (long) getpid());
+    if (bench_trace_shm(name) == 0) {
+        bench_trace_set(1);
+        measure("on, shared memory ring", call_traced, calls, 1, NULL);
+        bench_trace_close();
+    }
+#endif
+
+#if defined(API_TRACE_STRUCTURED) && !defined(PC)
+    bench_trace_set(0);
+    bench_trace_format(JSON);
+    measure("events compiled in, off", call_event, calls, 1, NULL);
+
+    bench_trace_file(path);
+    bench_trace_set(1);
+    measure("events on, JSON Lines file", call_event, calls, 1, NULL);
+    bench_trace_close();
+    bench_trace_set(0);
+    bench_trace_format(-1);
+#endif
+
+    printf("\n%-28s %8s %12s %10s %14s %10s\n", "contention", "threads", "calls", "ns/call", "syscalls/call", "scaling");
+    for (i = 1; i <= maxthreads; i *= 2) {
+        bench_trace_file(path);
+        bench_trace_set(1);
+        measure("on, shared file", call_traced, calls / i, i, &base);
+        bench_trace_close();
+    }
+    bench_trace_set(0);
+    unlink(path);
+    return status;
+}
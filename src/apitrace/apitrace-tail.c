@@ -0,0 +1,152 @@
+
+ /**
+  * @file apitrace-tail.c
+  * @brief prints apitrace output published to a shared memory ring
+  * @author thepainters@gmail.com
+  */
+
+/**
+ * The traced process sets API_TRACING_SHM, or calls API_trace_shm(),
+ * with a name such as `/mytrace`; then
+ * @code
+ *   apitrace-tail [-a] [-n] [-g text] /mytrace
+ * @endcode
+ * prints what it publishes from then on (from the oldest record still in
+ * the ring with -a), only events containing `text` with -g, and stops at
+ * the end of the ring rather than waiting for more with -n. The ring is
+ * mapped read only, so a slow viewer only loses records, reported on
+ * stderr, and never holds up the traced process.
+ *
+ * The ring holds the trace as it was flushed, cut into slots, so -g first
+ * puts the lines back together. An event is one line, as structured
+ * events are, or the `from file:line:func()` comment line and the line
+ * after it, as API_TRACE_FROM_FILE writes them. A line cut by lost records
+ * is dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "apitrace_ring.h"
+
+#define TAIL_LINE_MAX 65536
+
+/*
+ * the line being put back together, and a `from` line waiting for the
+ * line it belongs to.
+ */
+static char line[TAIL_LINE_MAX + 1];
+static size_t used = 0;
+static char from[TAIL_LINE_MAX + 1];
+static size_t fromlen = 0;
+
+/*
+ * prints the event ending with `line` if it contains `grep`.
+ */
+static void event(char *grep) {
+    line[used] = '\0';
+    if ((fromlen == 0) && (strncmp(line, "/* from ", 8) == 0)) {
+        memcpy(from, line, used + 1);
+        fromlen = used;
+    } else {
+        from[fromlen] = '\0';
+        if ((strstr(from, grep) != NULL) || (strstr(line, grep) != NULL)) {
+            fwrite(from, 1, fromlen, stdout);
+            fwrite(line, 1, used, stdout);
+        }
+        fromlen = 0;
+    }
+    used = 0;
+}
+
+/*
+ * adds the text of one slot to the line, printing each event completed.
+ */
+static void filter(char *grep, const char *text, size_t len) {
+    const char *eol = NULL;
+    size_t now = 0;
+    while (len > 0) {
+        eol = memchr(text, '\n', len);
+        now = (eol != NULL) ? (size_t) (eol - text) + 1 : len;
+        if (used + now > TAIL_LINE_MAX) now = TAIL_LINE_MAX - used;
+        memcpy(line + used, text, now);
+        used += now;
+        text += now;
+        len -= now;
+        if ((line[used - 1] == '\n') || (used == TAIL_LINE_MAX)) event(grep);
+    }
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [-a] [-n] [-g text] /name\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    struct api_ring *ring = NULL;
+    char record[API_RING_DATA];
+    char *grep = NULL;
+    uint64_t cursor = 0;
+    uint64_t head = 0;
+    uint64_t lost = 0;
+    int oldest = 0;
+    int follow = 1;
+    int len = 0;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "ang:")) != -1) {
+        switch (opt) {
+            case 'a': oldest = 1; break;
+            case 'n': follow = 0; break;
+            case 'g': grep = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    ring = api_ring_attach(argv[optind]);
+    if (ring == NULL) {
+        fprintf(stderr, "%s: no trace ring %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+    cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (oldest) cursor = (cursor > ring->slots) ? cursor - ring->slots : 0;
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - cursor > ring->slots) {
+            lost += (head - cursor) - ring->slots;
+            cursor = head - ring->slots;
+            used = 0;
+            fromlen = 0;
+        }
+        if (cursor == head) {
+            fflush(stdout);
+            if (! follow) break;
+            usleep(1000);
+            continue;
+        }
+        len = api_ring_read(ring, cursor, record);
+        if (len == -1) {
+            /* still being written */
+            if (! follow) break;
+            usleep(1000);
+            continue;
+        }
+        cursor++;
+        if (len == -2) {
+            lost++;
+            /* the rest of the line is gone */
+            used = 0;
+            fromlen = 0;
+            continue;
+        }
+        if (grep != NULL) filter(grep, record, len);
+        else fwrite(record, 1, len, stdout);
+        if (lost > 0) {
+            fprintf(stderr, "%s: lost %llu records\n", argv[0], (unsigned long long) lost);
+            lost = 0;
+        }
+    }
+    if ((grep != NULL) && (used > 0)) event(grep);
+    if ((grep != NULL) && (fromlen > 0)) event(grep);
+    api_ring_detach(ring);
+    return 0;
+}
@@ -11,8 +11,492 @@
 #ifdef PC
 #define __func__ __FUNCTION__
 #endif
+#if (defined(API_TRACE_SHM) || defined(API_TRACE_STRUCTURED)) && !defined(PC) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#if defined(API_TRACE_SHM) && !defined(PC) && defined(__GLIBC__) && !defined(__USE_GNU)
+#error "API_TRACE_SHM needs fopencookie: build with -D_GNU_SOURCE, or include apitrace.h before any system header"
+#endif
+
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+/*
+ * Per call site tracing, in the style of the kernel's dynamic debug.
+ *
+ * Built with API_TRACE_DYNAMIC, every API_TRACE, API_TRACE_FROM_FILE,
+ * API_TRACE_BLURB, API_TRACE_PRINT, API_TRACE_HIDE, API_TRACE_SHOW and
+ * API_TRACE_EVENT call site keeps a descriptor in the `api_trace_<API>`
+ * section, and traces only when its own enable bit is set, at the cost of
+ * one load and a branch when it is not. Bits are set by API_trace_set(),
+ * which sets or clears all of them, and by API_trace_control() or the
+ * API_TRACING_SITES environment variable, which take queries such as
+ *
+ *     func=foo*,file=bar.c;-line=10-20
+ *
+ * Queries are separated by `;`, a leading `-` clears rather than sets the
+ * bits, and every `key=glob` term of a query (func, file, line, fmt)
+ * must match. A query of just `+` or `-` matches every site. `file` matches either the path or its last component.
+ * API_TRACING, API_TRACE, API_TRACING_FILE and API_TRACING_SHM turn on
+ * every call site, and keep them on through API_trace_set(0), as they
+ * keep tracing on in other builds. Assigning API_TRACING directly no
+ * longer turns tracing on or off; call API_trace_set() instead. For the
+ * same reason, enabled call sites between API_TRACE_HIDE and
+ * API_TRACE_SHOW still trace, inside the comment those two write.
+ */
+#include <stdlib.h>
+#include <string.h>
+struct api_trace_site {
+    const char *file;
+    const char *func;
+    const char *fmt;
+    int line;
+    volatile char enabled;
+};
+
+static int __attribute__((unused)) api_trace_glob(const char *pattern, size_t len, const char *text) {
+    if (len == 0) return (*text == '\0');
+    if (*pattern == '*') {
+        for (;; text++) {
+            if (api_trace_glob(pattern + 1, len - 1, text)) return 1;
+            if (*text == '\0') return 0;
+        }
+    }
+    if (*text == '\0') return 0;
+    if ((*pattern != '?') && (*pattern != *text)) return 0;
+    return api_trace_glob(pattern + 1, len - 1, text + 1);
+}
+
+static int __attribute__((unused)) api_trace_term(struct api_trace_site *site, const char *term, size_t len) {
+    const char *value = memchr(term, '=', len);
+    const char *base = NULL;
+    size_t keylen = 0;
+    long low = 0, high = 0;
+    char *end = NULL;
+    if (value == NULL) return 0;
+    keylen = value - term;
+    value++;
+    len -= keylen + 1;
+    if ((keylen == 4) && (strncmp(term, "func", 4) == 0)) return api_trace_glob(value, len, site->func);
+    if ((keylen == 3) && (strncmp(term, "fmt", 3) == 0)) return api_trace_glob(value, len, site->fmt);
+    if ((keylen == 4) && (strncmp(term, "file", 4) == 0)) {
+        base = strrchr(site->file, '/');
+        if (api_trace_glob(value, len, site->file)) return 1;
+        return ((base != NULL) && api_trace_glob(value, len, base + 1));
+    }
+    if ((keylen == 4) && (strncmp(term, "line", 4) == 0)) {
+        low = high = strtol(value, &end, 10);
+        if ((end < value + len) && (*end == '-')) high = strtol(end + 1, &end, 10);
+        return ((site->line >= low) && (site->line <= high));
+    }
+    return 0;
+}
+
+/*
+ * applies a query to the call sites from start to stop,
+ * returning how many matched.
+ */
+static int __attribute__((unused)) api_trace_control_sites(struct api_trace_site *start,
+        struct api_trace_site *stop, const char *query) {
+    struct api_trace_site *site = NULL;
+    const char *next = NULL;
+    const char *term = NULL;
+    size_t qlen = 0, tlen = 0;
+    int matched = 0, all = 0;
+    char value = 1;
+    if (query == NULL) return 0;
+    for (; *query != '\0'; query = next) {
+        while ((*query == ';') || (*query == ' ')) query++;
+        next = query + strcspn(query, ";");
+        qlen = next - query;
+        /* only "+" and "-" match every site, not an empty query */
+        if (qlen == 0) continue;
+        value = 1;
+        if ((qlen > 0) && ((*query == '-') || (*query == '+'))) {
+            value = (*query == '+');
+            query++;
+            qlen--;
+        }
+        for (site = start; (site != NULL) && (site < stop); site++) {
+            all = 1;
+            for (term = query; all && (term < query + qlen); term += tlen + 1) {
+                tlen = strcspn(term, ", ;");
+                if (term + tlen > query + qlen) tlen = query + qlen - term;
+                if ((tlen > 0) && (! api_trace_term(site, term, tlen))) all = 0;
+            }
+            if (! all) continue;
+            site->enabled = value;
+            matched++;
+        }
+    }
+    return matched;
+}
+
+#define API_TRACE_SITE(API, fmt) \
+    static struct api_trace_site __attribute__((section("api_trace_" #API), used, aligned(sizeof(void *)))) \
+        api_trace_site_here = { __FILE__, __func__, fmt, __LINE__, 0 }
+#define API_TRACE_SITE_ENABLED (__builtin_expect(api_trace_site_here.enabled, 0))
+/* an enabled site traces to stderr once the stream is closed, as check_for_tracing does */
+#define API_TRACE_SITE_STREAM(API) \
+    if (API ## _TRACING_STREAM == NULL) API ## _TRACING_STREAM = stderr
+
+#define API_TRACING_SITES_DECLARE(API) \
+     extern struct api_trace_site __start_api_trace_ ## API[] __attribute__((weak)); \
+     extern struct api_trace_site __stop_api_trace_ ## API[] __attribute__((weak));
+#define API_TRACING_SITES_SET(API, val) \
+     api_trace_control_sites(__start_api_trace_ ## API, __stop_api_trace_ ## API, \
+                             ((val) || API ## _check_for_tracing()) ? "+" : "-");
+#define API_TRACING_SITES_INIT(API) \
+int API ## _trace_control(const char *query) { \
+    if (API ## _TRACING_STREAM == NULL) API ## _TRACING_STREAM = stderr; \
+    return api_trace_control_sites(__start_api_trace_ ## API, __stop_api_trace_ ## API, query); \
+} \
+static void __attribute__((constructor)) API ## _trace_sites_init(void) { \
+    if ((getenv(#API "_TRACING_FILE") != NULL) || (getenv(#API "_TRACING") != NULL) || \
+        (getenv(#API "_TRACE") != NULL) || (getenv(#API "_TRACING_SHM") != NULL)) { \
+        API ## _check_for_tracing(); \
+        API ## _trace_control("+"); \
+    } \
+    if (getenv(#API "_TRACING_SITES") != NULL) API ## _trace_control(getenv(#API "_TRACING_SITES")); \
+}
+#else
+#define API_TRACING_SITES_DECLARE(API)
+#define API_TRACING_SITES_SET(API, val)
+#define API_TRACING_SITES_INIT(API)
+#endif
+
+#if defined(API_TRACE_SHM) && !defined(PC)
+/*
+ * Live tracing to a viewer process.
+ *
+ * Built with API_TRACE_SHM, setting API_TRACING_SHM to a name such as
+ * `/mytrace`, or calling API_trace_shm(), sends the trace to the shared
+ * memory ring of that name, read with apitrace-tail, instead of a file.
+ * Each flush of the trace stream is copied into the ring without a system
+ * call, and a slow viewer loses records rather than slowing the process.
+ * Only the owner can read the ring, and API_trace_close() removes it; a
+ * viewer already attached keeps what was published. The stream is made
+ * with fopencookie, so apitrace.h has to come before any other include,
+ * or _GNU_SOURCE be defined for the build.
+ */
+#include <stdlib.h>
+#include "apitrace_ring.h"
+struct api_ring_cookie {
+    struct api_ring *ring;
+    char *name;
+};
+static ssize_t api_ring_cookie_write(void *cookie, const char *text, size_t len) {
+    api_ring_publish(((struct api_ring_cookie *) cookie)->ring, text, len);
+    return len;
+}
+static int api_ring_cookie_close(void *cookie) {
+    struct api_ring_cookie *that = (struct api_ring_cookie *) cookie;
+    api_ring_detach(that->ring);
+    shm_unlink(that->name);
+    free(that->name);
+    free(that);
+    return 0;
+}
+static __attribute__((unused)) FILE *api_ring_stream(const char *name) {
+    cookie_io_functions_t io = { NULL, api_ring_cookie_write, NULL, api_ring_cookie_close };
+    struct api_ring_cookie *cookie = (struct api_ring_cookie *) calloc(1, sizeof(struct api_ring_cookie));
+    FILE *stream = NULL;
+    if (cookie == NULL) return NULL;
+    cookie->ring = api_ring_create(name, API_RING_SLOTS);
+    cookie->name = strdup(name);
+    if ((cookie->ring == NULL) || (cookie->name == NULL)) {
+        if (cookie->ring != NULL) api_ring_detach(cookie->ring);
+        free(cookie->name);
+        free(cookie);
+        return NULL;
+    }
+    stream = fopencookie(cookie, "w", io);
+    if (stream == NULL) {
+        api_ring_cookie_close(cookie);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IOFBF, BUFSIZ);
+    return stream;
+}
+#define API_TRACING_SHM_CHECK(API) \
+    if ((void*)getenv(#API "_TRACING_SHM") != (void*) NULL) { \
+        if (API ##_TRACING_STREAM == (FILE *) NULL) { API ## _trace_shm( (char *) getenv (#API "_TRACING_SHM")); } \
+        return 1; \
+    };
+#define API_TRACING_SHM_INIT(API) \
+int API ## _trace_shm(char *name) { \
+    FILE *tmp = api_ring_stream(name); \
+    if ((FILE*) tmp == (FILE*) NULL) { \
+      API ## _TRACING_STREAM = stderr; \
+      return -1; \
+    } \
+    API ## _TRACING_STREAM = tmp; \
+    return 0; \
+}
+#else
+#define API_TRACING_SHM_CHECK(API)
+#define API_TRACING_SHM_INIT(API)
+#endif
+
+#if defined(API_TRACE_STRUCTURED) && !defined(PC)
+/*
+ * Structured trace events.
+ *
+ * Built with API_TRACE_STRUCTURED and linked with TextStream.c,
+ *
+ *     API_TRACE_EVENT(API, message, name, value, ...)
+ *
+ * writes a record of timestamp, thread, file, line, func, message and the
+ * name/value strings through a record TextUtilStream: JSON Lines, one XML
+ * element or one CSV row per event, chosen by API_TRACING_FORMAT (json,
+ * xml, csv, tcl or perl) or API_trace_format(). Each thread keeps its
+ * records in memory and writes API_EVENT_BATCH of them at a time with one
+ * write, and the rest when it exits. API_trace_events_flush(),
+ * API_TRACING_STOP and exit write what every thread still holds. Names and values are escaped for the format, so
+ * each record parses as JSON, XML, CSV, Tcl or Perl; a newline in a CSV
+ * value is written as `\n` to keep the row on one line. CSV has no names,
+ * so a row is timestamp, thread, file, line, func and message, then one
+ * `name=value` field per pair given, ending with a comma as every
+ * TextStream CSV row does. With no format set, events are
+ * written as API_TRACE_FROM_FILE writes them.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "../TextStream/TextStream.h"
+
+#define API_EVENT_BATCH 64
+
+struct api_event_batch {
+    FILE *memory;
+    char *text;
+    size_t length;
+    int count;
+    TextUtilStream *stream;
+    char *scratch;
+    size_t scratchsize;
+    pthread_mutex_t lock;
+    struct api_event_batch *next;
+};
+
+static __attribute__((unused)) int api_event_format(char *name) {
+    if (name == NULL) return -1;
+    if (strcasecmp(name, "json") == 0) return JSON;
+    if (strcasecmp(name, "xml") == 0) return XML;
+    if (strcasecmp(name, "csv") == 0) return CSV;
+    if (strcasecmp(name, "tcl") == 0) return TCL;
+    if (strcasecmp(name, "perl") == 0) return PERL;
+    return -1;
+}
+
+/*
+ * returns `value` escaped for `otype`, in the batch's scratch space,
+ * which the next call reuses.
+ */
+static __attribute__((unused)) char *api_event_escape(struct api_event_batch *batch, int otype, const char *value) {
+    size_t need = 0;
+    char *out = NULL;
+    unsigned char c = 0;
+    if (value == NULL) value = "";
+    need = (6 * strlen(value)) + 3;
+    if (need > batch->scratchsize) {
+        free(batch->scratch);
+        batch->scratch = (char *) malloc(need);
+        batch->scratchsize = (batch->scratch == NULL) ? 0 : need;
+        if (batch->scratch == NULL) return (char *) "";
+    }
+    out = batch->scratch;
+    if (otype == CSV) *out++ = '"';
+    for (; *value != '\0'; value++) {
+        c = (unsigned char) *value;
+        switch (otype) {
+            case JSON:
+                if ((c == '"') || (c == '\\')) { *out++ = '\\'; *out++ = c; }
+                else if (c == '\n') { *out++ = '\\'; *out++ = 'n'; }
+                else if (c == '\r') { *out++ = '\\'; *out++ = 'r'; }
+                else if (c == '\t') { *out++ = '\\'; *out++ = 't'; }
+                else if (c < 0x20) out += sprintf(out, "\\u%04x", c);
+                else *out++ = c;
+                break;
+            case XML:
+                if (c == '&') out += sprintf(out, "&amp;");
+                else if (c == '<') out += sprintf(out, "&lt;");
+                else if (c == '>') out += sprintf(out, "&gt;");
+                else if (c == '"') out += sprintf(out, "&quot;");
+                else if (c == '\'') out += sprintf(out, "&apos;");
+                else if ((c == '\n') || (c == '\r') || (c == '\t')) out += sprintf(out, "&#%d;", c);
+                else if (c >= 0x20) *out++ = c;
+                /* other control characters cannot appear in XML */
+                break;
+            case CSV:
+                if (c == '"') *out++ = '"';
+                *out++ = c;
+                break;
+            case TCL:
+                if ((c == '{') || (c == '}') || (c == '\\')) *out++ = '\\';
+                *out++ = c;
+                break;
+            case PERL:
+                if ((c == '\'') || (c == '\\')) *out++ = '\\';
+                *out++ = c;
+                break;
+            default:
+                *out++ = c;
+                break;
+        }
+    }
+    if (otype == CSV) *out++ = '"';
+    *out = '\0';
+    return batch->scratch;
+}
+
+static __attribute__((unused)) void api_event_timestamp(char *out, size_t size) {
+    struct timespec now;
+    struct tm when;
+    size_t len = 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &when);
+    len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &when);
+    snprintf(out + len, size - len, ".%09ldZ", (long) now.tv_nsec);
+}
+
+#define API_TRACING_EVENTS_DECLARE(API) \
+     void API ## _trace_events_flush(void);
+#define API_TRACING_EVENTS_CLOSE(API) \
+    API ## _trace_events_flush();
+#define API_TRACING_EVENTS_INIT(API) \
+int API ## _EVENT_FORMAT = -2; \
+static __thread struct api_event_batch API ## _event_batch = \
+    { NULL, NULL, 0, 0, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL }; \
+static pthread_key_t API ## _event_key; \
+static pthread_once_t API ## _event_once = PTHREAD_ONCE_INIT; \
+static pthread_mutex_t API ## _event_batches_lock = PTHREAD_MUTEX_INITIALIZER; \
+static struct api_event_batch *API ## _event_batches = NULL; \
+void API ## _trace_format(int otype) { \
+    API ## _EVENT_FORMAT = otype; \
+} \
+static void API ## _event_flush(struct api_event_batch *batch) { \
+    if (batch->memory == NULL) return; \
+    fflush(batch->memory); \
+    if ((batch->length > 0) && (API ## _TRACING_STREAM != NULL)) { \
+        writeTextUtilOutput(API ## _TRACING_STREAM, batch->text, batch->length); \
+    } \
+    fseeko(batch->memory, 0, SEEK_SET); \
+    batch->count = 0; \
+} \
+void API ## _trace_events_flush(void) { \
+    struct api_event_batch *batch = NULL; \
+    pthread_mutex_lock(&API ## _event_batches_lock); \
+    for (batch = API ## _event_batches; batch != NULL; batch = batch->next) { \
+        pthread_mutex_lock(&batch->lock); \
+        API ## _event_flush(batch); \
+        pthread_mutex_unlock(&batch->lock); \
+    } \
+    pthread_mutex_unlock(&API ## _event_batches_lock); \
+} \
+static void API ## _event_thread_exit(void *arg) { \
+    struct api_event_batch *batch = (struct api_event_batch *) arg; \
+    struct api_event_batch **link = NULL; \
+    pthread_mutex_lock(&API ## _event_batches_lock); \
+    for (link = &API ## _event_batches; *link != NULL; link = &(*link)->next) { \
+        if (*link == batch) { \
+            *link = batch->next; \
+            break; \
+        } \
+    } \
+    pthread_mutex_unlock(&API ## _event_batches_lock); \
+    API ## _event_flush(batch); \
+    destroy(batch->stream); \
+    fclose(batch->memory); \
+    free(batch->text); \
+    free(batch->scratch); \
+    batch->memory = NULL; \
+    batch->text = NULL; \
+    batch->length = 0; \
+    batch->count = 0; \
+    batch->stream = NULL; \
+    batch->scratch = NULL; \
+    batch->scratchsize = 0; \
+    batch->next = NULL; \
+} \
+static void API ## _event_setup(void) { \
+    pthread_key_create(&API ## _event_key, API ## _event_thread_exit); \
+    atexit(API ## _trace_events_flush); \
+} \
+void API ## _trace_event(const char *file, int line, const char *func, char *message, ...) { \
+    struct api_event_batch *batch = &API ## _event_batch; \
+    TextUtilStream *record = NULL; \
+    va_list pairs; \
+    char when[64]; \
+    char thread[32]; \
+    char *name = NULL; \
+    char *value = NULL; \
+    char *escaped = NULL; \
+    int otype = 0; \
+    if (API ## _EVENT_FORMAT == -2) API ## _EVENT_FORMAT = api_event_format(getenv(#API "_TRACING_FORMAT")); \
+    if ((API ## _EVENT_FORMAT >= 0) && (batch->stream == NULL)) { \
+        pthread_once(&API ## _event_once, API ## _event_setup); \
+        batch->memory = open_memstream(&batch->text, &batch->length); \
+        if (batch->memory != NULL) { \
+            batch->stream = newRecordTextUtilStream(batch->memory, (OutputType) API ## _EVENT_FORMAT); \
+            pthread_setspecific(API ## _event_key, batch); \
+            pthread_mutex_lock(&API ## _event_batches_lock); \
+            batch->next = API ## _event_batches; \
+            API ## _event_batches = batch; \
+            pthread_mutex_unlock(&API ## _event_batches_lock); \
+        } \
+    } \
+    va_start(pairs, message); \
+    if (batch->stream == NULL) { \
+        fprintf(API ## _TRACING_STREAM, "\n/* from %s:%d:%s()*/\n\t%s", file, line, func, message); \
+        while ((name = va_arg(pairs, char *)) != NULL) fprintf(API ## _TRACING_STREAM, " %s=%s", name, va_arg(pairs, char *)); \
+        fprintf(API ## _TRACING_STREAM, "\n"); \
+        fflush(API ## _TRACING_STREAM); \
+        va_end(pairs); \
+        return; \
+    } \
+    api_event_timestamp(when, sizeof(when)); \
+    snprintf(thread, sizeof(thread), "%lu", (unsigned long) pthread_self()); \
+    otype = batch->stream->otype; \
+    /* API_trace_events_flush() may be writing this batch from another thread */ \
+    pthread_mutex_lock(&batch->lock); \
+    record = createObject(batch->stream, "event"); \
+    addString(record, "timestamp", when); \
+    addString(record, "thread", thread); \
+    addString(record, "file", api_event_escape(batch, otype, file)); \
+    addNumber(record, "line", line); \
+    addString(record, "func", api_event_escape(batch, otype, func)); \
+    addString(record, "message", api_event_escape(batch, otype, message)); \
+    while ((name = va_arg(pairs, char *)) != NULL) { \
+        value = va_arg(pairs, char *); \
+        if (otype == CSV) { \
+            /* CSV writes no names, so the field carries it */ \
+            escaped = (char *) malloc(strlen(name) + strlen((value != NULL) ? value : "") + 2); \
+            if (escaped != NULL) sprintf(escaped, "%s=%s", name, (value != NULL) ? value : ""); \
+            addString(record, name, api_event_escape(batch, otype, (escaped != NULL) ? escaped : name)); \
+        } else { \
+            escaped = strdup(api_event_escape(batch, otype, name)); \
+            addString(record, (escaped != NULL) ? escaped : name, api_event_escape(batch, otype, value)); \
+        } \
+        free(escaped); \
+    } \
+    va_end(pairs); \
+    destroy(record); \
+    if (++batch->count >= API_EVENT_BATCH) API ## _event_flush(batch); \
+    pthread_mutex_unlock(&batch->lock); \
+}
+#else
+#define API_TRACING_EVENTS_DECLARE(API)
+#define API_TRACING_EVENTS_CLOSE(API)
+#define API_TRACING_EVENTS_INIT(API)
+#endif
+
 #define API_TRACING_INIT(API) \
+     API_TRACING_SITES_DECLARE(API) \
+     API_TRACING_EVENTS_DECLARE(API) \
      short API ## _TRACING = 0; \
      short API ## _TRACING_SAVE = 0; \
      FILE * API ## _TRACING_STREAM = (FILE *) NULL; \
@@ -30,7 +514,9 @@ void API ## _trace_file(char *file) { \
       API ## _TRACING_STREAM = stderr; \
     } \
 } \
+API_TRACING_SHM_INIT(API) \
 int API ## _check_for_tracing() { \
+    API_TRACING_SHM_CHECK(API) \
     if ((void*)getenv(#API "_TRACING_FILE") != (void*) NULL) { \
         if (API ##_TRACING_STREAM == (FILE *) NULL) { API ## _trace_file( (char *) getenv (#API "_TRACING_FILE")); } \
         return 1; \
@@ -41,19 +527,32 @@ int API ## _check_for_tracing() { \
     return API ## _TRACING; \
 } \
 void API ## _trace_close(void) { \
+    API_TRACING_EVENTS_CLOSE(API) \
     if ((void*) API ## _TRACING_STREAM != (FILE*) NULL) fclose(API ## _TRACING_STREAM); \
     API ## _TRACING_STREAM = NULL; \
 } \
 void API ## _trace_set(int val) { \
     API ## _TRACING = val; \
     if (API ## _TRACING_STREAM == NULL) API ## _TRACING_STREAM = stderr; \
+    API_TRACING_SITES_SET(API, val) \
 } \
  \
 FILE* API ## _trace_stream() { \
   return API ## _TRACING_STREAM; \
-}
+} \
+API_TRACING_SITES_INIT(API) \
+API_TRACING_EVENTS_INIT(API)
 
 #define API_TRACING_STREAM(API) ((API ##_trace_stream() == NULL) ? stdout : API ##_trace_stream())
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+#define API_TRACE_FROM_FILE(API,fmt, ...) \
+        do { API_TRACE_SITE(API, fmt); if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ##_TRACING_STREAM, "\n/* from %s:%d:%s()*/\n\t" fmt "\n",  __FILE__, \
+                                __LINE__, __func__ , __VA_ARGS__); fflush ((FILE *) API ##_TRACING_STREAM);} } while (0)
+#define API_TRACE(API,fmt, ...) \
+        do { API_TRACE_SITE(API, fmt); if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ##_TRACING_STREAM, "\n\t" fmt "\n", __VA_ARGS__); fflush((FILE *) API ##_TRACING_STREAM);} } while (0)
+#define API_TRACE_BLURB(API,fmt, ...) \
+        do { API_TRACE_SITE(API, fmt); if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ##_TRACING_STREAM, fmt,  __VA_ARGS__);} } while (0)
+#else
 #define API_TRACE_FROM_FILE(API,fmt, ...) \
         do { if (API ##_check_for_tracing()) fprintf(API ##_TRACING_STREAM, "\n/* from %s:%d:%s()*/\n\t" fmt "\n",  __FILE__, \
                                 __LINE__, __func__ , __VA_ARGS__); fflush ((FILE *) API ##_TRACING_STREAM);} while (0)
@@ -61,20 +560,278 @@ FILE* API ## _trace_stream() { \
         do { if (API ##_check_for_tracing()) { fprintf(API ##_TRACING_STREAM, "\n\t" fmt "\n", __VA_ARGS__); fflush((FILE *) API ##_TRACING_STREAM);} } while (0)
 #define API_TRACE_BLURB(API,fmt, ...) \
         do { if (API ##_check_for_tracing()) {fprintf(API ##_TRACING_STREAM, fmt,  __VA_ARGS__);} } while (0)
+#endif
 
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+#define API_TRACE_HIDE(API) \
+        do { API_TRACE_SITE(API, "HIDE"); API ##_TRACING_SAVE= API ##_TRACING; if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ## _TRACING_STREAM, "\n/*\n");} API ## _TRACING=0;} while (0)
+
+#define API_TRACE_SHOW(API) \
+        do { API_TRACE_SITE(API, "SHOW"); API ## _TRACING=API ## _TRACING_SAVE; if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ## _TRACING_STREAM, "\n*/\n");fflush ((FILE *) API ##_TRACING_STREAM);} } while (0)
+#else
 #define API_TRACE_HIDE(API) \
         do { API ##_TRACING_SAVE= API ##_TRACING; if ( API ## _check_for_tracing()) fprintf(API ## _TRACING_STREAM, "\n/*\n"); API ## _TRACING=0;} while (0)
 
 #define API_TRACE_SHOW(API) \
         do { API ## _TRACING=API ## _TRACING_SAVE; if (API ## _check_for_tracing()) fprintf(API ## _TRACING_STREAM, "\n*/\n");fflush ((FILE *) API ##_TRACING_STREAM); } while (0)
+#endif
 
+#if defined(API_TRACE_STRUCTURED) && !defined(PC) && defined(API_TRACE_DYNAMIC)
+#define API_TRACE_EVENT(API, ...) \
+        do { API_TRACE_SITE(API, #__VA_ARGS__); if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); \
+             API ## _trace_event(__FILE__, __LINE__, __func__, __VA_ARGS__, (char *) NULL);} } while (0)
+#elif defined(API_TRACE_STRUCTURED) && !defined(PC)
+#define API_TRACE_EVENT(API, ...) \
+        do { if (API ##_check_for_tracing()) { \
+             API ## _trace_event(__FILE__, __LINE__, __func__, __VA_ARGS__, (char *) NULL);} } while (0)
+#endif
+
+#if defined(API_TRACE_DYNAMIC) && !defined(PC)
+#define API_TRACE_PRINT(API,fmt, ...) \
+        do { API_TRACE_SITE(API, fmt); if (API_TRACE_SITE_ENABLED) { API_TRACE_SITE_STREAM(API); fprintf(API ## _TRACING_STREAM, "\n/*\n" fmt "\n*/\n", __VA_ARGS__); fflush ((FILE *) API ##_TRACING_STREAM);} \
+        else { FILE *api_print_stream = (API ## _TRACING_STREAM != NULL) ? API ## _TRACING_STREAM : stderr; \
+               fprintf(api_print_stream, fmt, __VA_ARGS__); fflush (api_print_stream);} } while (0)
+#else
 #define API_TRACE_PRINT(API,fmt, ...) \
         do { if (API ## _check_for_tracing()) {fprintf(API ## _TRACING_STREAM, "\n/*\n" fmt "\n*/\n", __VA_ARGS__); fflush ((FILE *) API ##_TRACING_STREAM);} \
         else { fprintf(API ## _TRACING_STREAM, fmt, __VA_ARGS__); fflush (API ##_TRACING_STREAM);} } while (0)
+#endif
 
 #define API_TRACING_STOP(API) \
         do { API ## _trace_close(); } while(0)
 
+#if defined(API_TRACE_FUNCTIONS) && !defined(PC)
+/*
+ * Whole program call tracing through gcc/clang -finstrument-functions.
+ *
+ * Build with API_TRACE_FUNCTIONS and -finstrument-functions, and put
+ * API_TRACING_FUNCTIONS(API) in one file. While API_FUNCTIONS_FILE is set,
+ * or between API_functions_start() and API_functions_stop(), every call
+ * and return is kept as callee, caller and CLOCK_MONOTONIC time in a
+ * buffer per thread, and written to the file as lines of
+ *
+ *     E|X callee caller nanoseconds thread
+ *
+ * when the buffer fills or the thread exits. Nothing is symbolized in
+ * the process: the executable mappings are written as
+ * `# map start-end offset path` lines, so `addr2line -f -e path`
+ * can be given `callee - start + offset` afterwards. API_FUNCTIONS_FILTER,
+ * `low-high` in hex, or API_functions_filter() keeps only callees in
+ * that address range. When tracing stops, only the stopping thread's
+ * records are written: records still buffered in other threads are
+ * lost, and never written into the file of a later start.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define API_FUNCTIONS_RECORDS 4096
+#define API_NO_INSTRUMENT __attribute__((no_instrument_function, unused))
+
+struct api_function_record {
+    void *callee;
+    void *caller;
+    uint64_t when;
+    char kind;
+};
+
+struct api_function_buffer {
+    int count;
+    int session;
+    unsigned long thread;
+    struct api_function_record records[API_FUNCTIONS_RECORDS];
+};
+
+/*
+ * `writers` counts threads between loading `fd` and their last write to
+ * it, so api_functions_stop() closes it only once none can still write.
+ * `session` counts starts; a buffer kept from an earlier one is dropped.
+ */
+static struct {
+    volatile int enabled;
+    int fd;
+    int writers;
+    int session;
+    uintptr_t low;
+    uintptr_t high;
+    pthread_key_t key;
+    pthread_once_t once;
+} api_functions = { 0, -1, 0, 0, 0, UINTPTR_MAX, 0, PTHREAD_ONCE_INIT };
+
+static __thread struct api_function_buffer *api_functions_buffer = NULL;
+static __thread int api_functions_busy = 0;
+
+static int API_NO_INSTRUMENT api_functions_hold(void) {
+    __atomic_add_fetch(&api_functions.writers, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&api_functions.fd, __ATOMIC_SEQ_CST);
+}
+
+static void API_NO_INSTRUMENT api_functions_release(void) {
+    __atomic_sub_fetch(&api_functions.writers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void API_NO_INSTRUMENT api_functions_write(int fd, const char *text, size_t len) {
+    ssize_t done = 0;
+    while ((len > 0) && (fd >= 0)) {
+        done = write(fd, text, len);
+        if ((done < 0) && (errno == EINTR)) continue;
+        if (done <= 0) return;
+        text += done;
+        len -= done;
+    }
+}
+
+static void API_NO_INSTRUMENT api_functions_flush(struct api_function_buffer *buffer) {
+    char text[65536];
+    size_t len = 0;
+    int fd = api_functions_hold();
+    int i = 0;
+    if (buffer->session != __atomic_load_n(&api_functions.session, __ATOMIC_SEQ_CST)) buffer->count = 0;
+    for (i = 0; (fd >= 0) && (i < buffer->count); i++) {
+        if (len + 128 > sizeof(text)) {
+            api_functions_write(fd, text, len);
+            len = 0;
+        }
+        len += snprintf(text + len, sizeof(text) - len, "%c %p %p %llu %lu\n", buffer->records[i].kind,
+                        buffer->records[i].callee, buffer->records[i].caller,
+                        (unsigned long long) buffer->records[i].when, buffer->thread);
+    }
+    api_functions_write(fd, text, len);
+    api_functions_release();
+    buffer->count = 0;
+}
+
+static void API_NO_INSTRUMENT api_functions_thread_exit(void *arg) {
+    api_functions_flush((struct api_function_buffer *) arg);
+    free(arg);
+    api_functions_buffer = NULL;
+}
+
+static void API_NO_INSTRUMENT api_functions_make_key(void) {
+    pthread_key_create(&api_functions.key, api_functions_thread_exit);
+}
+
+static void API_NO_INSTRUMENT api_functions_record(void *callee, void *caller, char kind) {
+    struct api_function_buffer *buffer = api_functions_buffer;
+    struct api_function_record *record = NULL;
+    struct timespec now;
+    if (! api_functions.enabled) return;
+    if (((uintptr_t) callee < api_functions.low) || ((uintptr_t) callee > api_functions.high)) return;
+    if (buffer == NULL) {
+        if (api_functions_busy) return;
+        api_functions_busy = 1;
+        buffer = (struct api_function_buffer *) malloc(sizeof(struct api_function_buffer));
+        if (buffer != NULL) {
+            buffer->count = 0;
+            buffer->session = __atomic_load_n(&api_functions.session, __ATOMIC_SEQ_CST);
+            buffer->thread = (unsigned long) pthread_self();
+            pthread_once(&api_functions.once, api_functions_make_key);
+            pthread_setspecific(api_functions.key, buffer);
+            api_functions_buffer = buffer;
+        }
+        api_functions_busy = 0;
+        if (buffer == NULL) return;
+    }
+    if (buffer->session != api_functions.session) {
+        /* left over from an earlier start */
+        buffer->count = 0;
+        buffer->session = __atomic_load_n(&api_functions.session, __ATOMIC_SEQ_CST);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record = &buffer->records[buffer->count++];
+    record->callee = callee;
+    record->caller = caller;
+    record->when = ((uint64_t) now.tv_sec * 1000000000ull) + now.tv_nsec;
+    record->kind = kind;
+    if (buffer->count == API_FUNCTIONS_RECORDS) api_functions_flush(buffer);
+}
+
+/*
+ * writes the executable mappings, for symbolizing the trace afterwards.
+ */
+static void API_NO_INSTRUMENT api_functions_maps(void) {
+    char line[4096];
+    char text[4200];
+    char perms[8];
+    unsigned long start = 0, end = 0, offset = 0;
+    int path = 0;
+    int fd = -1;
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) return;
+    fd = api_functions_hold();
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        path = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offset, &path) < 4) continue;
+        if ((strchr(perms, 'x') == NULL) || (path == 0) || (line[path] != '/')) continue;
+        line[strcspn(line, "\n")] = '\0';
+        api_functions_write(fd, text, snprintf(text, sizeof(text), "# map %lx-%lx %lx %s\n",
+                                               start, end, offset, line + path));
+    }
+    api_functions_release();
+    fclose(maps);
+}
+
+static void API_NO_INSTRUMENT api_functions_stop(void) {
+    int fd = -1;
+    if (__atomic_load_n(&api_functions.fd, __ATOMIC_SEQ_CST) < 0) return;
+    api_functions.enabled = 0;
+    if (api_functions_buffer != NULL) api_functions_flush(api_functions_buffer);
+    api_functions_maps();
+    fd = __atomic_exchange_n(&api_functions.fd, -1, __ATOMIC_SEQ_CST);
+    if (fd < 0) return;
+    /* other threads may still be writing to it */
+    while (__atomic_load_n(&api_functions.writers, __ATOMIC_SEQ_CST) > 0) sched_yield();
+    close(fd);
+}
+
+static int API_NO_INSTRUMENT api_functions_start(char *file) {
+    static int registered = 0;
+    int fd = -1;
+    if (__atomic_load_n(&api_functions.fd, __ATOMIC_SEQ_CST) >= 0) api_functions_stop();
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) return -1;
+    __atomic_add_fetch(&api_functions.session, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&api_functions.fd, fd, __ATOMIC_SEQ_CST);
+    if (! registered) atexit(api_functions_stop);
+    registered = 1;
+    api_functions.enabled = 1;
+    return 0;
+}
+
+#define API_TRACING_FUNCTIONS(API) \
+void API_NO_INSTRUMENT __cyg_profile_func_enter(void *callee, void *caller) { \
+    api_functions_record(callee, caller, 'E'); \
+} \
+void API_NO_INSTRUMENT __cyg_profile_func_exit(void *callee, void *caller) { \
+    api_functions_record(callee, caller, 'X'); \
+} \
+int API_NO_INSTRUMENT API ## _functions_start(char *file) { \
+    return api_functions_start(file); \
+} \
+void API_NO_INSTRUMENT API ## _functions_stop(void) { \
+    api_functions_stop(); \
+} \
+void API_NO_INSTRUMENT API ## _functions_filter(void *low, void *high) { \
+    api_functions.low = (uintptr_t) low; \
+    api_functions.high = (uintptr_t) high; \
+} \
+static void __attribute__((constructor, no_instrument_function)) API ## _functions_init(void) { \
+    char *filter = getenv(#API "_FUNCTIONS_FILTER"); \
+    char *high = NULL; \
+    if (filter != NULL) { \
+        api_functions.low = (uintptr_t) strtoull(filter, &high, 16); \
+        if (*high == '-') api_functions.high = (uintptr_t) strtoull(high + 1, NULL, 16); \
+    } \
+    if (getenv(#API "_FUNCTIONS_FILE") != NULL) api_functions_start(getenv(#API "_FUNCTIONS_FILE")); \
+}
+#endif
+
 
 
 /*
@@ -0,0 +1,136 @@
+
+
+ /**
+  * @file apitrace_ring.h
+  * @brief shared memory ring carrying apitrace output to apitrace-tail
+  * @author thepainters@gmail.com
+  */
+
+#ifndef __API_TRACE_RING_INCLUDED__
+#define __API_TRACE_RING_INCLUDED__
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The traced process only copies into the ring and bumps `head`, so it
+ * never makes a system call per event and never waits for a reader.
+ * Record n goes into slot n % slots, whose `seq` is odd while it is
+ * written and 2n+2 once it is complete. A reader that sees any other
+ * value, before or after copying, has been lapped and skips the record.
+ */
+#define API_RING_MAGIC 0x61706974
+#define API_RING_SLOTS 4096
+#define API_RING_DATA 496
+
+struct api_ring_slot {
+    uint64_t seq;
+    uint32_t len;
+    uint32_t pad;
+    char data[API_RING_DATA];
+};
+
+struct api_ring {
+    uint32_t magic;
+    uint32_t slots;
+    uint64_t head;
+    struct api_ring_slot slot[];
+};
+
+static __attribute__((unused)) size_t api_ring_size(uint32_t slots) {
+    return sizeof(struct api_ring) + (slots * sizeof(struct api_ring_slot));
+}
+
+/*
+ * creates, or reuses, the ring `name` (which starts with '/') for writing.
+ */
+static __attribute__((unused)) struct api_ring *api_ring_create(const char *name, uint32_t slots) {
+    struct api_ring *ring = NULL;
+    struct stat info;
+    size_t size = api_ring_size(slots);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return NULL;
+    if ((fstat(fd, &info) != 0) || (((size_t) info.st_size != size) && (ftruncate(fd, size) != 0))) {
+        close(fd);
+        return NULL;
+    }
+    ring = (struct api_ring *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) return NULL;
+    if ((ring->magic != API_RING_MAGIC) || (ring->slots != slots)) {
+        memset(ring, 0, size);
+        ring->slots = slots;
+        __atomic_store_n(&ring->magic, API_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+    return ring;
+}
+
+/*
+ * maps the ring `name` read only, for a viewer.
+ */
+static __attribute__((unused)) struct api_ring *api_ring_attach(const char *name) {
+    struct api_ring *ring = NULL;
+    struct stat info;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    if ((fstat(fd, &info) != 0) || ((size_t) info.st_size < sizeof(struct api_ring))) {
+        close(fd);
+        return NULL;
+    }
+    ring = (struct api_ring *) mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) return NULL;
+    if ((__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != API_RING_MAGIC) ||
+        (api_ring_size(ring->slots) > (size_t) info.st_size)) {
+        munmap(ring, info.st_size);
+        return NULL;
+    }
+    return ring;
+}
+
+static __attribute__((unused)) void api_ring_detach(struct api_ring *ring) {
+    munmap(ring, api_ring_size(ring->slots));
+}
+
+/*
+ * adds text to the ring, over as many slots as it needs.
+ */
+static __attribute__((unused)) void api_ring_publish(struct api_ring *ring, const char *text, size_t len) {
+    struct api_ring_slot *slot = NULL;
+    uint64_t n = 0;
+    size_t now = 0;
+    do {
+        now = (len > API_RING_DATA) ? API_RING_DATA : len;
+        n = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+        slot = &ring->slot[n % ring->slots];
+        __atomic_store_n(&slot->seq, (2 * n) + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(slot->data, text, now);
+        slot->len = now;
+        __atomic_store_n(&slot->seq, (2 * n) + 2, __ATOMIC_RELEASE);
+        text += now;
+        len -= now;
+    } while (len > 0);
+}
+
+/*
+ * copies record n into `out`, which holds API_RING_DATA bytes. Returns
+ * its length, -1 if it is not written yet, or -2 if it was overwritten.
+ */
+static __attribute__((unused)) int api_ring_read(struct api_ring *ring, uint64_t n, char *out) {
+    struct api_ring_slot *slot = &ring->slot[n % ring->slots];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    uint32_t len = 0;
+    if (seq < (2 * n) + 2) return -1;
+    if (seq > (2 * n) + 2) return -2;
+    len = slot->len;
+    if (len > API_RING_DATA) return -2;
+    memcpy(out, slot->data, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return -2;
+    return (int) len;
+}
+#endif